@@ -0,0 +1,436 @@
+/*
+ * Standalone scanhash benchmark, built and run by "make bench".
+ *
+ * Every compiled CPU kernel this machine can run scans a fixed range of
+ * nonces ending at the known winner of each block in bench_block.h, and
+ * must find exactly that nonce, but nothing once the target is lowered to
+ * just below the winner's hash.  The lane-packed 4way kernel scans a
+ * different block in each lane and must report each winner on its own lane,
+ * and nothing once every lane's target is lowered the same way.  The bulk
+ * variants must also carry on past a share when their array fills up.
+ * Rates, TSC cycles per hash and the spread across repetitions are printed
+ * as a table, or as JSON with -j.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "miner.h"
+#include "bench_block.h"
+
+#define BENCH_RANGE	(1 << 20)
+#define BENCH_REPS	5
+
+/* What util.c and the kernels otherwise get from main.c */
+bool opt_debug = false;
+bool opt_protocol = false;
+bool opt_log_output = false;
+bool use_syslog = false;
+struct work_restart *work_restart;
+
+void log_curses(int prio, const char *f, va_list ap)
+{
+	vfprintf(stderr, f, ap);
+	fputc('\n', stderr);
+}
+
+void quit(int status, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_curses(LOG_ERR, format, ap);
+	va_end(ap);
+	exit(status);
+}
+
+typedef bool (*scan_bool_func)(int, const unsigned char *, unsigned char *,
+	unsigned char *, unsigned char *, const unsigned char *,
+	uint32_t, unsigned long *, uint32_t);
+typedef unsigned int (*scan_nonce_func)(int, const unsigned char *, unsigned char *,
+	unsigned char *, unsigned char *, const unsigned char *,
+	uint32_t, unsigned long *, uint32_t);
+typedef int (*scan_bulk_func)(int, const unsigned char *, unsigned char *,
+	unsigned char *, unsigned char *, const unsigned char *,
+	uint32_t, unsigned long *, uint32_t, uint32_t *, int);
+
+struct bench_kernel {
+	const char	*name;
+	void		*func;
+	bool		returns_nonce;	/* nonce or -1 rather than bool */
+	unsigned int	cpu;		/* CPU_* features needed */
+	bool		lanes;		/* one block per lane, see bench_lanes */
+	void		*bulk;		/* _bulk variant, see bench_resume */
+};
+
+static const struct bench_kernel kernels[] = {
+	{ "c",		(void *)scanhash_c,		false,	0 },
+	{ "c_precalc",	(void *)scanhash_c_precalc,	false,	0 },
+	{ "cryptopp",	(void *)scanhash_cryptopp,	false,	0 },
+#ifdef WANT_CRYPTOPP_ASM32
+	{ "cryptopp_asm32", (void *)scanhash_asm32,	false,	0 },
+#endif
+#ifdef WANT_SSE2_4WAY
+	{ "4way",	(void *)ScanHash_4WaySSE2,	true,	CPU_SSE2,
+	  false,	(void *)ScanHash_4WaySSE2_bulk },
+	{ "4way_lanes",	(void *)ScanHash_4WaySSE2_lanes, false,	CPU_SSE2,	true },
+#endif
+#ifdef WANT_X8632_SSE2
+	{ "sse2_32",	(void *)scanhash_sse2_32,	true,	CPU_SSE2 },
+#endif
+#ifdef WANT_X8664_SSE2
+	{ "sse2_64",	(void *)scanhash_sse2_64,	true,	CPU_SSE2 },
+#endif
+#ifdef WANT_X8664_SSE4
+	{ "sse4_64",	(void *)scanhash_sse4_64,	true,	CPU_SSE4_1 },
+#endif
+#ifdef WANT_AVX2_8WAY
+	{ "avx2_8way",	(void *)ScanHash_8WayAVX2,	true,	CPU_AVX2,
+	  false,	(void *)ScanHash_8WayAVX2_bulk },
+#endif
+#ifdef WANT_AVX512_16WAY
+	{ "avx512_16way", (void *)ScanHash_16WayAVX512,	true,	CPU_AVX512,
+	  false,	(void *)ScanHash_16WayAVX512_bulk },
+#endif
+#ifdef WANT_SHANI
+	{ "shani",	(void *)scanhash_shani,		false,	CPU_SHA },
+#endif
+};
+
+struct bench_block {
+	const char	*name;
+	unsigned char	block[256];	/* data, hash1, midstate, target */
+	uint32_t	nonce;
+};
+
+static const struct bench_block blocks[] = {
+	{ "genesis",	{ CGMINER_BENCH_BLOCK_GENESIS },	CGMINER_BENCH_NONCE_GENESIS },
+	{ "block1",	{ CGMINER_BENCH_BLOCK_BLOCK1 },		CGMINER_BENCH_NONCE_BLOCK1 },
+	{ "block2",	{ CGMINER_BENCH_BLOCK_BLOCK2 },		CGMINER_BENCH_NONCE_BLOCK2 },
+	{ "block100000", { CGMINER_BENCH_BLOCK_BLOCK100000 },	CGMINER_BENCH_NONCE_BLOCK100000 },
+};
+
+static uint64_t bench_ticks(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Lower work's target to just below the hash of nonce */
+static void target_below(struct work *work, uint32_t nonce)
+{
+	uint32_t *target = (uint32_t *)work->target;
+	uint32_t hash[8];
+	int i;
+
+	memcpy(work->data + 64 + 12, &nonce, sizeof(nonce));
+	sha256_double(work->midstate, work->data + 64, work->hash1, (unsigned char *)hash);
+
+	/* fulltest() reads the hash byte swapped against the target */
+	for (i = 0; i < 8; i++)
+		target[i] = swab32(hash[i]);
+	for (i = 0; i < 8 && !target[i]--; i++)
+		;
+}
+
+#ifdef WANT_SSE2_4WAY
+/*
+ * Lane-packed scan: lane l gets blocks[l], started a different distance
+ * before its winner, and every lane must report its own block's nonce.
+ * With below, each lane's target is just under its winner's hash and no
+ * lane may report anything.
+ */
+static bool bench_lanes(double *usecs, uint64_t *ticks, bool below)
+{
+	struct work work[SCAN_LANES] __attribute__((aligned(128)));
+	struct scan_lane lanes[SCAN_LANES];
+	uint32_t nonces[SCAN_LANES * 2];
+	int nonce_lanes[SCAN_LANES * 2];
+	unsigned long hashes_done = 0;
+	struct timeval tv_start, tv_end;
+	bool seen[SCAN_LANES] = { false };
+	int found, f, l;
+	uint64_t tsc;
+
+	for (l = 0; l < SCAN_LANES; l++) {
+		const struct bench_block *b = &blocks[l % (sizeof(blocks) / sizeof(blocks[0]))];
+
+		memset(&work[l], 0, sizeof(work[l]));
+		memcpy(&work[l], b->block, sizeof(b->block));
+		if (below)
+			target_below(&work[l], b->nonce);
+		lanes[l].midstate = work[l].midstate;
+		lanes[l].data = work[l].data + 64;
+		lanes[l].hash1 = work[l].hash1;
+		lanes[l].target = work[l].target;
+		lanes[l].nonce = b->nonce - (BENCH_RANGE - 1) + l * (BENCH_RANGE / 8);
+	}
+	work_restart[0].restart = 0;
+
+	gettimeofday(&tv_start, NULL);
+	tsc = bench_ticks();
+	found = ScanHash_4WaySSE2_lanes(0, lanes, BENCH_RANGE, &hashes_done,
+					nonces, nonce_lanes, SCAN_LANES * 2);
+	*ticks = bench_ticks() - tsc;
+	gettimeofday(&tv_end, NULL);
+
+	*usecs = (tv_end.tv_sec - tv_start.tv_sec) * 1e6 +
+		 (tv_end.tv_usec - tv_start.tv_usec);
+
+	if (below)
+		return !found;
+	for (f = 0; f < found; f++) {
+		l = nonce_lanes[f];
+		if (l < 0 || l >= SCAN_LANES || seen[l] ||
+		    nonces[f] != blocks[l % (sizeof(blocks) / sizeof(blocks[0]))].nonce)
+			return false;
+		seen[l] = true;
+	}
+	return found == SCAN_LANES && hashes_done == BENCH_RANGE;
+}
+#endif
+
+/* One scan of BENCH_RANGE nonces up to the winner; false if it was missed */
+static bool bench_once(const struct bench_kernel *k, const struct bench_block *b,
+		       double *usecs, uint64_t *ticks)
+{
+	struct work work __attribute__((aligned(128)));
+	uint32_t start = b->nonce - BENCH_RANGE;
+	unsigned long hashes_done = 0;
+	struct timeval tv_start, tv_end;
+	uint64_t tsc;
+	uint32_t found;
+	bool hit;
+
+#ifdef WANT_SSE2_4WAY
+	if (k->lanes)
+		return bench_lanes(usecs, ticks, false);
+#endif
+
+	memset(&work, 0, sizeof(work));
+	memcpy(&work, b->block, sizeof(b->block));
+	work_restart[0].restart = 0;
+
+	gettimeofday(&tv_start, NULL);
+	tsc = bench_ticks();
+	if (k->returns_nonce) {
+		scan_nonce_func func = (scan_nonce_func)k->func;
+
+		hit = func(0, work.midstate, work.data + 64, work.hash1, work.hash,
+			   work.target, b->nonce + 256, &hashes_done, start) != -1;
+	} else {
+		scan_bool_func func = (scan_bool_func)k->func;
+
+		hit = func(0, work.midstate, work.data + 64, work.hash1, work.hash,
+			   work.target, b->nonce + 256, &hashes_done, start);
+	}
+	*ticks = bench_ticks() - tsc;
+	gettimeofday(&tv_end, NULL);
+
+	*usecs = (tv_end.tv_sec - tv_start.tv_sec) * 1e6 +
+		 (tv_end.tv_usec - tv_start.tv_usec);
+
+	memcpy(&found, work.data + 64 + 12, sizeof(found));
+	return hit && found == b->nonce;
+}
+
+/*
+ * The same scan against a target just below the winner's own hash must come
+ * up empty, or the kernel passed fulltest() something other than that hash.
+ */
+static bool bench_reject(const struct bench_kernel *k, const struct bench_block *b)
+{
+	struct work work __attribute__((aligned(128)));
+	unsigned long hashes_done = 0;
+	bool hit;
+
+#ifdef WANT_SSE2_4WAY
+	if (k->lanes) {
+		double usecs;
+		uint64_t ticks;
+
+		return bench_lanes(&usecs, &ticks, true);
+	}
+#endif
+
+	memset(&work, 0, sizeof(work));
+	memcpy(&work, b->block, sizeof(b->block));
+	target_below(&work, b->nonce);
+	work_restart[0].restart = 0;
+
+	if (k->returns_nonce) {
+		scan_nonce_func func = (scan_nonce_func)k->func;
+
+		hit = func(0, work.midstate, work.data + 64, work.hash1, work.hash,
+			   work.target, b->nonce + 256, &hashes_done, b->nonce - 256) != -1;
+	} else {
+		scan_bool_func func = (scan_bool_func)k->func;
+
+		hit = func(0, work.midstate, work.data + 64, work.hash1, work.hash,
+			   work.target, b->nonce + 256, &hashes_done, b->nonce - 256);
+	}
+	return !hit;
+}
+
+/*
+ * A bulk scan that fills its share array must report a point to carry on
+ * from that is past the last share, so resuming there can't find it again.
+ */
+static bool bench_resume(const struct bench_kernel *k, const struct bench_block *b)
+{
+	scan_bulk_func func = (scan_bulk_func)k->bulk;
+	struct work work __attribute__((aligned(128)));
+	unsigned long hashes_done = 0;
+	uint32_t nonce;
+
+	if (!func)
+		return true;
+
+	memset(&work, 0, sizeof(work));
+	memcpy(&work, b->block, sizeof(b->block));
+	work_restart[0].restart = 0;
+
+	if (func(0, work.midstate, work.data + 64, work.hash1, work.hash, work.target,
+		 b->nonce + 256, &hashes_done, b->nonce - 256, &nonce, 1) != 1 ||
+	    nonce != b->nonce)
+		return false;
+	return !func(0, work.midstate, work.data + 64, work.hash1, work.hash, work.target,
+		     b->nonce + 256, &hashes_done, hashes_done, &nonce, 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j] [-r reps] [-k kernel]\n"
+		"\t-j\t\tprint JSON instead of a table\n"
+		"\t-r reps\t\trepetitions per kernel and block (default: %d)\n"
+		"\t-k kernel\tonly run the named kernel\n", prog, BENCH_REPS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	int reps = BENCH_REPS;
+	bool json = false;
+	bool first = true;
+	int failures = 0;
+	size_t i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jr:k:")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = true;
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			if (reps < 1)
+				usage(argv[0]);
+			break;
+		case 'k':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	work_restart = calloc(1, sizeof(*work_restart));
+	if (!work_restart)
+		quit(1, "Failed to calloc work_restart");
+
+	if (json)
+		printf("{\n  \"package\": \"%s\",\n  \"range\": %d,\n  \"reps\": %d,\n  \"results\": [",
+		       PACKAGE_STRING, BENCH_RANGE, reps);
+	else
+		printf("%-14s %-12s %12s %12s %10s  %s\n", "kernel", "block",
+		       "MH/s", "cycles/hash", "spread", "nonce");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		const struct bench_kernel *k = &kernels[i];
+
+		if (only && strcmp(only, k->name))
+			continue;
+		if ((cpu_features() & k->cpu) != k->cpu) {
+			if (!json)
+				printf("%-14s skipped, not supported by this CPU\n", k->name);
+			continue;
+		}
+
+		/* the lane-packed kernel scans all the blocks at once */
+		for (j = 0; j < (k->lanes ? 1 : sizeof(blocks) / sizeof(blocks[0])); j++) {
+			const struct bench_block *b = &blocks[j];
+			const char *name = k->lanes ? "per-lane" : b->name;
+			double hashes = k->lanes ? BENCH_RANGE * SCAN_LANES : BENCH_RANGE;
+			double rate, sum = 0, min = 0, max = 0;
+			uint64_t ticks, best_ticks = 0;
+			bool ok = true;
+			double usecs;
+			int r;
+
+			for (r = 0; r < reps; r++) {
+				ok &= bench_once(k, b, &usecs, &ticks);
+				rate = usecs > 0 ? hashes / usecs : 0;
+				sum += rate;
+				if (!r || rate < min)
+					min = rate;
+				if (!r || rate > max)
+					max = rate;
+				if (!r || ticks < best_ticks)
+					best_ticks = ticks;
+			}
+			rate = sum / reps;
+			ok &= bench_reject(k, b);
+			ok &= bench_resume(k, b);
+			if (!ok)
+				failures++;
+
+			if (json) {
+				printf("%s\n    { \"kernel\": \"%s\", \"block\": \"%s\", \"ok\": %s, "
+				       "\"hashes_per_sec\": %.0f, \"min\": %.0f, \"max\": %.0f, "
+				       "\"spread_pct\": %.2f, ",
+				       first ? "" : ",", k->name, name, ok ? "true" : "false",
+				       rate * 1e6, min * 1e6, max * 1e6,
+				       rate > 0 ? (max - min) * 100 / rate : 0);
+				if (best_ticks)
+					printf("\"cycles_per_hash\": %.1f }",
+					       (double)best_ticks / hashes);
+				else
+					printf("\"cycles_per_hash\": null }");
+				first = false;
+			} else {
+				printf("%-14s %-12s %12.3f %12.1f %9.1f%%  %s\n",
+				       k->name, name, rate,
+				       (double)best_ticks / hashes,
+				       rate > 0 ? (max - min) * 100 / rate : 0,
+				       ok ? "ok" : "MISSED");
+			}
+			fflush(stdout);
+		}
+	}
+
+	if (json)
+		printf("\n  ],\n  \"failures\": %d\n}\n", failures);
+
+	free(work_restart);
+	return failures ? 1 : 0;
+}
@@ -36,4 +36,89 @@
                 0x55, 0xF1, 0x44, 0x4E, 0x00, 0x00, 0x00, 0x00, 0x79, 0x63, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, \
                 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,                                                 \
 
+	// Known mainnet blocks for the bench program, laid out like the block
+	// above but with the nonce cleared and a difficulty 1 target.  The
+	// matching _NONCE is the winning nonce as the kernels see it in data+76;
+	// no other difficulty 1 share lies within 2^20 nonces below it.
+
+	// genesis
+        #define CGMINER_BENCH_BLOCK_GENESIS                                             \
+                0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0xFD, 0xED, 0xA3, 0x3B, 0xB2, 0x12, 0x7B, 0x7A, 0x3E, 0x2C, 0xC7, 0x7A, \
+                0x61, 0x8F, 0x76, 0x67, 0xC3, 0x1B, 0xC8, 0x7F, 0x32, 0x51, 0x8A, 0x88, 0xAA, 0xB8, 0x9F, 0x3A, \
+                0x4A, 0x5E, 0x1E, 0x4B, 0x49, 0x5F, 0xAB, 0x29, 0x1D, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, \
+                0x33, 0x9A, 0x90, 0xBC, 0xF0, 0xBF, 0x58, 0x63, 0x7D, 0xAC, 0xCC, 0x90, 0xA8, 0xCA, 0x59, 0x1E, \
+                0xE9, 0xD8, 0xC8, 0xC3, 0xC8, 0x03, 0x01, 0x4F, 0x36, 0x87, 0xB1, 0x96, 0x1B, 0xF9, 0x19, 0x47, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00
+        #define CGMINER_BENCH_NONCE_GENESIS 0x1DAC2B7C
+
+	// block 1
+        #define CGMINER_BENCH_BLOCK_BLOCK1                                              \
+                0x00, 0x00, 0x00, 0x01, 0x0A, 0x8C, 0xE2, 0x6F, 0x72, 0xB3, 0xF1, 0xB6, 0x46, 0xA2, 0xA6, 0xC1, \
+                0x4F, 0xF7, 0x63, 0xAE, 0x65, 0x83, 0x1E, 0x93, 0x9C, 0x08, 0x5A, 0xE1, 0x00, 0x19, 0xD6, 0x68, \
+                0x00, 0x00, 0x00, 0x00, 0xFD, 0x51, 0x20, 0x98, 0x44, 0xA7, 0x4B, 0x1E, 0x0E, 0x68, 0xBE, 0xBB, \
+                0x67, 0x14, 0xEE, 0x1F, 0xC3, 0xA3, 0xA1, 0x7B, 0xB1, 0xF7, 0x0B, 0x54, 0xE8, 0x06, 0xB6, 0xCD, \
+                0x0E, 0x3E, 0x23, 0x57, 0x49, 0x66, 0xBC, 0x61, 0x1D, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, \
+                0x23, 0x13, 0xF6, 0xA9, 0x30, 0x2A, 0xBB, 0x7F, 0xD4, 0xA2, 0x6C, 0x06, 0x69, 0x78, 0x61, 0x7D, \
+                0xE0, 0x0E, 0xBD, 0xCC, 0x75, 0x7B, 0x75, 0x28, 0x6F, 0x64, 0xF2, 0x5F, 0xAC, 0x01, 0x75, 0x0E, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00
+        #define CGMINER_BENCH_NONCE_BLOCK1 0x01E36299
+
+	// block 2
+        #define CGMINER_BENCH_BLOCK_BLOCK2                                              \
+                0x00, 0x00, 0x00, 0x01, 0x18, 0xEB, 0x60, 0x48, 0x20, 0x16, 0x1B, 0xBF, 0x90, 0x94, 0x7E, 0xE3, \
+                0x75, 0x42, 0x8A, 0xFC, 0xD7, 0x6F, 0x41, 0x14, 0x86, 0xAB, 0x59, 0x51, 0x83, 0x9A, 0x8E, 0x68, \
+                0x00, 0x00, 0x00, 0x00, 0x54, 0xCC, 0xFD, 0xD5, 0x1C, 0xDE, 0x25, 0x1E, 0xED, 0xDD, 0x5A, 0x7A, \
+                0xB8, 0x58, 0x48, 0xF2, 0x9F, 0x5C, 0x66, 0xBB, 0x4E, 0x74, 0xEF, 0x36, 0x60, 0x31, 0x2C, 0xE4, \
+                0x9B, 0x0F, 0xC9, 0x22, 0x49, 0x66, 0xBC, 0xB0, 0x1D, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, \
+                0xCC, 0x0E, 0x0F, 0xBC, 0x8E, 0xFB, 0xB5, 0x6D, 0xE6, 0xFE, 0xF9, 0xFC, 0x0F, 0xA3, 0xD4, 0xBA, \
+                0xDD, 0x05, 0x35, 0xE2, 0x06, 0x20, 0xA0, 0xC9, 0x64, 0x07, 0xE4, 0x32, 0x74, 0x0E, 0xBD, 0x66, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00
+        #define CGMINER_BENCH_NONCE_BLOCK2 0x08D2BD61
+
+	// block 100000
+        #define CGMINER_BENCH_BLOCK_BLOCK100000                                         \
+                0x00, 0x00, 0x00, 0x01, 0x19, 0x01, 0x12, 0x50, 0x04, 0x61, 0x2A, 0x17, 0x01, 0xC3, 0xA6, 0x21, \
+                0xD9, 0x30, 0xD3, 0x1D, 0x36, 0xB6, 0x07, 0xDF, 0x1F, 0xCC, 0xC2, 0x16, 0x00, 0x02, 0xD0, 0x1C, \
+                0x00, 0x00, 0x00, 0x00, 0x25, 0xA9, 0x57, 0x66, 0xC0, 0xD5, 0xAC, 0x2A, 0x96, 0x09, 0x94, 0xB2, \
+                0x22, 0x95, 0xFF, 0xEC, 0x7C, 0x06, 0xC3, 0x28, 0x85, 0x48, 0x8D, 0xC3, 0xAC, 0xA4, 0xB5, 0xEF, \
+                0xF3, 0xE9, 0x47, 0x42, 0x4D, 0x1B, 0x22, 0x37, 0x1B, 0x04, 0x86, 0x4C, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, \
+                0x29, 0x5B, 0x80, 0x7C, 0x8A, 0xD5, 0x64, 0xAB, 0x52, 0x32, 0x76, 0xB7, 0x76, 0xE9, 0x03, 0x5E, \
+                0xD6, 0x08, 0xEE, 0x58, 0x2C, 0x94, 0xC4, 0x30, 0xEB, 0x92, 0x8D, 0xE7, 0x6B, 0x6C, 0xF9, 0xFF, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, \
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00
+        #define CGMINER_BENCH_NONCE_BLOCK100000 0x0F2B5710
+
 #endif // !defined(__BENCH_BLOCK_H__)
@@ -161,6 +161,8 @@ struct pc_data {
 	pthread_t pth;
 };
 
+static struct obj_pool pc_data_pool = OBJ_POOL("pc_data", struct pc_data);
+
 static void *postcalc_hash(void *userdata)
 {
 	struct pc_data *pcd = (struct pc_data *)userdata;
@@ -228,29 +230,24 @@ cycle:
 	if (entry < FOUND)
 		goto cycle;
 out:
-	free(pcd);
+	obj_free(&work_pool, pcd->work);
+	obj_free(&pc_data_pool, pcd);
 	return NULL;
 }
 
 void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 {
-	struct pc_data *pcd = malloc(sizeof(struct pc_data));
-	if (unlikely(!pcd)) {
-		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_hash_async");
-		return;
-	}
-	pcd->work = calloc(1, sizeof(struct work));
-	if (unlikely(!pcd->work)) {
-		applog(LOG_ERR, "Failed to malloc work in postcalc_hash_async");
-		return;
-	}
+	struct pc_data *pcd = obj_alloc(&pc_data_pool);
 
+	pcd->work = obj_alloc(&work_pool);
 	pcd->thr = thr;
 	memcpy(pcd->work, work, sizeof(struct work));
 	memcpy(&pcd->res, res, BUFFERSIZE);
 
 	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
 		applog(LOG_ERR, "Failed to create postcalc_hash thread");
+		obj_free(&work_pool, pcd->work);
+		obj_free(&pc_data_pool, pcd);
 		return;
 	}
 }
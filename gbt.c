@@ -0,0 +1,570 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <jansson.h>
+
+#include "miner.h"
+
+/*
+ * Work built locally from a getblocktemplate (BIP 22) response.  The coinbase
+ * made here carries an 8 byte extranonce, and every new extranonce gives a new
+ * merkle root and with it a fresh 2^32 nonce space, so one template feeds any
+ * number of work items without going back to the server.  Solutions go back
+ * as whole blocks through submitblock.  Stratum jobs (see stratum.c) come in
+ * the same form, with the pool's coinbase around our extranonce2.
+ *
+ * When merged mining, the coinbase also commits to a block of an aux chain
+ * got from its getauxblock, and a solution that is good enough for the aux
+ * chain goes to it as an auxpow: the coinbase, its merkle branch and the
+ * header that proves the work was done.
+ */
+
+#define GBT_XNONCE_LEN	8
+#define GBT_CB_MAX	512
+#define GBT_SIG_MAX	100	/* coinbase script size consensus allows */
+#define AUX_MAGIC	"\xfa\xbe" "mm"
+
+static void sha256d(const unsigned char *ptr, size_t len, unsigned char *hash)
+{
+	unsigned char first[32];
+
+	sha256(ptr, len, first);
+	sha256(first, 32, hash);
+}
+
+static void reverse32(unsigned char *dst, const unsigned char *src)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		dst[i] = src[31 - i];
+}
+
+static unsigned char *put_le32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		*p++ = v >> (i * 8);
+	return p;
+}
+
+static unsigned char *put_le64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		*p++ = v >> (i * 8);
+	return p;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	if (v < 0xfd) {
+		*p++ = v;
+		return p;
+	}
+	if (v <= 0xffff) {
+		*p++ = 0xfd;
+		*p++ = v;
+		*p++ = v >> 8;
+		return p;
+	}
+	if (v <= 0xffffffffULL) {
+		*p++ = 0xfe;
+		return put_le32(p, v);
+	}
+	*p++ = 0xff;
+	return put_le64(p, v);
+}
+
+/* Write the extranonce little endian into its len bytes of coinbase */
+void gbt_put_xnonce(unsigned char *p, uint64_t xnonce, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		*p++ = i < 8 ? xnonce >> (i * 8) : 0;
+}
+
+/* The block height as BIP 34 wants it pushed at the start of the coinbase */
+static unsigned char *put_height(unsigned char *p, int64_t height)
+{
+	unsigned char num[9];
+	int n = 0;
+
+	if (!height) {
+		*p++ = 0x00;
+		return p;
+	}
+	if (height <= 16) {
+		*p++ = 0x50 + height;
+		return p;
+	}
+	while (height) {
+		num[n++] = height & 0xff;
+		height >>= 8;
+	}
+	if (num[n - 1] & 0x80)
+		num[n++] = 0;
+	*p++ = n;
+	memcpy(p, num, n);
+	return p + n;
+}
+
+static const char b58_digits[] =
+	"123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+/* Decode a base58check address into the output script that pays it */
+bool gbt_payout_script(const char *addr, unsigned char *script, size_t *len)
+{
+	unsigned char raw[25], check[32];
+	const char *p;
+	int i;
+
+	memset(raw, 0, sizeof(raw));
+	for (p = addr; *p; p++) {
+		const char *digit = strchr(b58_digits, *p);
+		int carry;
+
+		if (!digit)
+			return false;
+		carry = digit - b58_digits;
+		for (i = sizeof(raw) - 1; i >= 0; i--) {
+			carry += raw[i] * 58;
+			raw[i] = carry & 0xff;
+			carry >>= 8;
+		}
+		if (carry)
+			return false;
+	}
+
+	sha256d(raw, 21, check);
+	if (memcmp(check, raw + 21, 4))
+		return false;
+
+	switch (raw[0]) {
+	case 0x05:	/* pay to script hash, main and test networks */
+	case 0xc4:
+		script[0] = 0xa9;
+		script[1] = 0x14;
+		memcpy(script + 2, raw + 1, 20);
+		script[22] = 0x87;
+		*len = 23;
+		break;
+	default:	/* pay to pubkey hash */
+		script[0] = 0x76;
+		script[1] = 0xa9;
+		script[2] = 0x14;
+		memcpy(script + 3, raw + 1, 20);
+		script[23] = 0x88;
+		script[24] = 0xac;
+		*len = 25;
+		break;
+	}
+	return true;
+}
+
+void gbt_free(struct gbt_tmpl *tmpl)
+{
+	if (!tmpl)
+		return;
+	free(tmpl->coinbase);
+	free(tmpl->branch);
+	free(tmpl->txdata);
+	free(tmpl->job_id);
+	free(tmpl->lp_id);
+	free(tmpl->lp_uri);
+	free(tmpl);
+}
+
+/*
+ * Fold the other transactions' ids into the merkle branch of the coinbase,
+ * so each work item's root is just its coinbase hash hashed up the branch.
+ * hashes[0] is the coinbase's slot and hashes[] has room for one more.
+ */
+static void gbt_branch(struct gbt_tmpl *tmpl, unsigned char (*hashes)[32], int count)
+{
+	int i, j;
+
+	while (count > 1) {
+		memcpy(tmpl->branch[tmpl->nbranch++], hashes[1], 32);
+		if (count & 1) {
+			memcpy(hashes[count], hashes[count - 1], 32);
+			count++;
+		}
+		for (i = 2, j = 1; i < count; i += 2, j++)
+			sha256d(hashes[i], 64, hashes[j]);
+		count = j;
+	}
+}
+
+/* The coinbase up to its extranonce: height, the server's flags, then ours */
+static bool gbt_coinbase(struct gbt_tmpl *tmpl, const json_t *res,
+			 const unsigned char *script, size_t script_len,
+			 const struct aux_block *aux)
+{
+	const char *flags = NULL, *commit;
+	size_t flags_len = 0, commit_len = 0;
+	unsigned char *p, *sig_len;
+	json_t *cbaux;
+
+	cbaux = json_object_get(res, "coinbaseaux");
+	if (cbaux)
+		flags = json_string_value(json_object_get(cbaux, "flags"));
+	if (flags)
+		flags_len = strlen(flags) / 2;
+	commit = json_string_value(json_object_get(res, "default_witness_commitment"));
+	if (commit)
+		commit_len = strlen(commit) / 2;
+	if (flags_len > 64 || commit_len > 128 || script_len > 64)
+		return false;
+
+	p = tmpl->coinbase = malloc(GBT_CB_MAX);
+	if (unlikely(!p))
+		return false;
+	p = put_le32(p, 1);
+	*p++ = 1;
+	memset(p, 0, 32);
+	p = put_le32(p + 32, 0xffffffff);
+	sig_len = p++;
+	p = put_height(p, json_integer_value(json_object_get(res, "height")));
+	if (flags_len) {
+		if (!hex2bin(p, flags, flags_len))
+			return false;
+		p += flags_len;
+	}
+	if (aux) {
+		/* The aux chain's merkle root, here just its one block, with
+		 * the tree's size and nonce */
+		*p++ = 44;
+		memcpy(p, AUX_MAGIC, 4);
+		memcpy(p + 4, aux->hash, 32);
+		p = put_le32(p + 36, 1);
+		p = put_le32(p, 0);
+		tmpl->aux = *aux;
+	}
+	*p++ = GBT_XNONCE_LEN;
+	tmpl->cb_xnonce = p - tmpl->coinbase;
+	tmpl->xnonce_len = GBT_XNONCE_LEN;
+	memset(p, 0, GBT_XNONCE_LEN);
+	p += GBT_XNONCE_LEN;
+	if (p - sig_len - 1 > GBT_SIG_MAX)
+		return false;
+	*sig_len = p - sig_len - 1;
+	p = put_le32(p, 0xffffffff);
+
+	*p++ = commit_len ? 2 : 1;
+	p = put_le64(p, json_integer_value(json_object_get(res, "coinbasevalue")));
+	*p++ = script_len;
+	memcpy(p, script, script_len);
+	p += script_len;
+	if (commit_len) {
+		p = put_le64(p, 0);
+		*p++ = commit_len;
+		if (!hex2bin(p, commit, commit_len))
+			return false;
+		p += commit_len;
+		tmpl->segwit = true;
+	}
+	p = put_le32(p, 0);
+	tmpl->cb_len = p - tmpl->coinbase;
+	return true;
+}
+
+struct gbt_tmpl *gbt_decode(const json_t *res, const unsigned char *script,
+			    size_t script_len, const struct aux_block *aux)
+{
+	const char *prevhash, *bits, *target, *lp_id, *lp_uri;
+	unsigned char (*hashes)[32] = NULL;
+	unsigned char bin[32];
+	struct gbt_tmpl *tmpl;
+	size_t data_len = 0;
+	json_t *txs;
+	char *pos;
+	int i, n;
+
+	prevhash = json_string_value(json_object_get(res, "previousblockhash"));
+	bits = json_string_value(json_object_get(res, "bits"));
+	target = json_string_value(json_object_get(res, "target"));
+	txs = json_object_get(res, "transactions");
+	if (!prevhash || !bits || !target || !json_is_array(txs) ||
+	    !json_is_integer(json_object_get(res, "coinbasevalue")) ||
+	    !json_is_integer(json_object_get(res, "height"))) {
+		applog(LOG_ERR, "JSON invalid block template");
+		return NULL;
+	}
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (unlikely(!tmpl)) {
+		applog(LOG_ERR, "Failed to calloc in gbt_decode");
+		return NULL;
+	}
+	tmpl->version = json_integer_value(json_object_get(res, "version"));
+	tmpl->curtime = json_integer_value(json_object_get(res, "curtime"));
+	tmpl->bits = strtoul(bits, NULL, 16);
+	if (!hex2bin(bin, prevhash, 32))
+		goto err_out;
+	reverse32(tmpl->prevhash, bin);
+	if (!hex2bin(bin, target, 32))
+		goto err_out;
+	reverse32(tmpl->target, bin);
+	gettimeofday(&tmpl->tv_fetched, NULL);
+
+	/* The longpollid goes back verbatim in a quoted JSON string */
+	lp_id = json_string_value(json_object_get(res, "longpollid"));
+	lp_uri = json_string_value(json_object_get(res, "longpolluri"));
+	if (lp_id && !lp_id[strcspn(lp_id, "\\\"")]) {
+		tmpl->lp_id = strdup(lp_id);
+		if (lp_uri)
+			tmpl->lp_uri = strdup(lp_uri);
+	}
+
+	/* The other transactions: ids for the merkle tree, data for the block */
+	n = json_array_size(txs);
+	hashes = calloc(n + 2, sizeof(*hashes));
+	tmpl->branch = calloc(n + 1, sizeof(*tmpl->branch));
+	if (unlikely(!hashes || !tmpl->branch))
+		goto err_out;
+	for (i = 0; i < n; i++) {
+		json_t *tx = json_array_get(txs, i);
+		const char *data = json_string_value(json_object_get(tx, "data"));
+		const char *txid = json_string_value(json_object_get(tx, "txid"));
+
+		if (!txid)
+			txid = json_string_value(json_object_get(tx, "hash"));
+		if (!data || !txid || !hex2bin(bin, txid, 32))
+			goto err_out;
+		reverse32(hashes[i + 1], bin);
+		data_len += strlen(data);
+	}
+	pos = tmpl->txdata = malloc(data_len + 1);
+	if (unlikely(!pos))
+		goto err_out;
+	*pos = '\0';
+	for (i = 0; i < n; i++) {
+		const char *data = json_string_value(json_object_get(json_array_get(txs, i), "data"));
+
+		strcpy(pos, data);
+		pos += strlen(data);
+	}
+	tmpl->ntx = n;
+	gbt_branch(tmpl, hashes, n + 1);
+	free(hashes);
+	hashes = NULL;
+
+	if (!gbt_coinbase(tmpl, res, script, script_len, aux))
+		goto err_out;
+	return tmpl;
+
+err_out:
+	applog(LOG_ERR, "JSON invalid block template");
+	free(hashes);
+	gbt_free(tmpl);
+	return NULL;
+}
+
+/* Both little endian 256 bit numbers, as work->target is */
+static bool below_target(const unsigned char *hash, const unsigned char *target)
+{
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		if (hash[i] != target[i])
+			return hash[i] < target[i];
+	}
+	return true;
+}
+
+/* The solved header of work back in wire order, and its hash */
+static void gbt_header(const struct work *work, unsigned char *hdr, unsigned char *hash)
+{
+	const uint32_t *data32 = (const uint32_t *)work->data;
+	uint32_t header[20];
+	int i;
+
+	for (i = 0; i < 20; i++)
+		header[i] = swab32(data32[i]);
+	memcpy(hdr, header, 80);
+	sha256d(hdr, 80, hash);
+}
+
+/* Whether work's solution is good enough for target */
+bool gbt_meets(const struct work *work, const unsigned char *target)
+{
+	unsigned char hdr[80], hash[32];
+
+	gbt_header(work, hdr, hash);
+	return below_target(hash, target);
+}
+
+/* Fill work with a header under the template's next extranonce, pool_lock held */
+void gbt_work(struct gbt_tmpl *tmpl, struct work *work)
+{
+	unsigned char root[32], pair[64];
+	uint32_t header[32], *data32 = (uint32_t *)work->data;
+	unsigned char *hdr = (unsigned char *)header;
+	struct timeval now;
+	int i;
+
+	work->extranonce = ++tmpl->extranonce;
+	gbt_put_xnonce(tmpl->coinbase + tmpl->cb_xnonce, work->extranonce, tmpl->xnonce_len);
+	sha256d(tmpl->coinbase, tmpl->cb_len, root);
+	for (i = 0; i < tmpl->nbranch; i++) {
+		memcpy(pair, root, 32);
+		memcpy(pair + 32, tmpl->branch[i], 32);
+		sha256d(pair, 64, root);
+	}
+
+	gettimeofday(&now, NULL);
+	memset(header, 0, sizeof(header));
+	put_le32(hdr, tmpl->version);
+	memcpy(hdr + 4, tmpl->prevhash, 32);
+	memcpy(hdr + 36, root, 32);
+	put_le32(hdr + 68, tmpl->curtime + (now.tv_sec - tmpl->tv_fetched.tv_sec));
+	put_le32(hdr + 72, tmpl->bits);
+	/* SHA-256 padding for the 80 byte header */
+	hdr[80] = 0x80;
+	hdr[126] = 0x02;
+	hdr[127] = 0x80;
+
+	/* getwork sends the data with each 32 bit word byte swapped */
+	for (i = 0; i < 32; i++)
+		data32[i] = swab32(header[i]);
+	sha256_midstate(work->midstate, work->data);
+
+	memset(work->hash1, 0, sizeof(work->hash1));
+	work->hash1[35] = 0x80;
+	work->hash1[61] = 0x01;
+	/* Look for whichever of the parent and aux chain is easier */
+	if (tmpl->aux.id && below_target(tmpl->target, tmpl->aux.target))
+		memcpy(work->target, tmpl->aux.target, sizeof(work->target));
+	else
+		memcpy(work->target, tmpl->target, sizeof(work->target));
+	memset(work->hash, 0, sizeof(work->hash));
+	work->tmpl_id = tmpl->id;
+	work->tv_staged = now;
+}
+
+/* The submitblock request for the block work's solution completes */
+char *gbt_submit_req(const struct gbt_tmpl *tmpl, const struct work *work)
+{
+	unsigned char cb[GBT_CB_MAX + 40], count[9], *p = cb;
+	const uint32_t *data32 = (const uint32_t *)work->data;
+	char *hdr_hex, *count_hex, *cb_hex, *req = NULL;
+	uint32_t header[20];
+	int i;
+
+	/* The header back in wire order, nonce and all */
+	for (i = 0; i < 20; i++)
+		header[i] = swab32(data32[i]);
+
+	/* The coinbase goes in a segwit block with its witness reserved value */
+	if (tmpl->segwit) {
+		memcpy(p, tmpl->coinbase, 4);
+		p[4] = 0x00;
+		p[5] = 0x01;
+		memcpy(p + 6, tmpl->coinbase + 4, tmpl->cb_len - 8);
+		gbt_put_xnonce(p + 6 + tmpl->cb_xnonce - 4, work->extranonce, tmpl->xnonce_len);
+		p += tmpl->cb_len - 2;
+		*p++ = 0x01;
+		*p++ = 0x20;
+		memset(p, 0, 32);
+		p += 32;
+		memcpy(p, tmpl->coinbase + tmpl->cb_len - 4, 4);
+		p += 4;
+	} else {
+		memcpy(p, tmpl->coinbase, tmpl->cb_len);
+		gbt_put_xnonce(p + tmpl->cb_xnonce, work->extranonce, tmpl->xnonce_len);
+		p += tmpl->cb_len;
+	}
+
+	hdr_hex = bin2hex((unsigned char *)header, 80);
+	count_hex = bin2hex(count, put_varint(count, tmpl->ntx + 1) - count);
+	cb_hex = bin2hex(cb, p - cb);
+	if (likely(hdr_hex && count_hex && cb_hex)) {
+		req = malloc(strlen(hdr_hex) + strlen(count_hex) + strlen(cb_hex) +
+			     strlen(tmpl->txdata) + 64);
+		if (likely(req))
+			sprintf(req, "{\"method\": \"submitblock\", \"params\": [ \"%s%s%s%s\" ], \"id\":1}\r\n",
+				hdr_hex, count_hex, cb_hex, tmpl->txdata);
+	}
+	free(hdr_hex);
+	free(count_hex);
+	free(cb_hex);
+	return req;
+}
+
+/* Take the aux block to merge mine from a getauxblock result */
+bool aux_decode(const json_t *res, struct aux_block *aux)
+{
+	const char *hash, *target;
+
+	hash = json_string_value(json_object_get(res, "hash"));
+	/* little endian either way, "target" is what older daemons call it */
+	target = json_string_value(json_object_get(res, "_target"));
+	if (!target)
+		target = json_string_value(json_object_get(res, "target"));
+	if (!hash || !target || strlen(hash) != 64 || strlen(target) != 64 ||
+	    !hex2bin(aux->hash, hash, 32) || !hex2bin(aux->target, target, 32)) {
+		applog(LOG_ERR, "JSON invalid aux block");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The getauxblock request handing work's solution to the aux chain.  The
+ * auxpow is the parent coinbase as a merkle transaction (the tx, the parent
+ * block hash, its branch and index), then the empty branch of our one block
+ * aux chain tree and the parent header.
+ */
+char *gbt_auxpow_req(const struct gbt_tmpl *tmpl, const struct work *work)
+{
+	unsigned char hdr[80], hash[32], *auxpow, *p;
+	char *hash_hex, *auxpow_hex = NULL, *req = NULL;
+	int i;
+
+	auxpow = malloc(tmpl->cb_len + 32 + 9 + tmpl->nbranch * 32 + 4 + 1 + 4 + 80);
+	if (unlikely(!auxpow))
+		return NULL;
+	gbt_header(work, hdr, hash);
+	p = auxpow;
+	memcpy(p, tmpl->coinbase, tmpl->cb_len);
+	gbt_put_xnonce(p + tmpl->cb_xnonce, work->extranonce, tmpl->xnonce_len);
+	p += tmpl->cb_len;
+	memcpy(p, hash, 32);
+	p = put_varint(p + 32, tmpl->nbranch);
+	for (i = 0; i < tmpl->nbranch; i++) {
+		memcpy(p, tmpl->branch[i], 32);
+		p += 32;
+	}
+	p = put_le32(p, 0);
+	*p++ = 0;
+	p = put_le32(p, 0);
+	memcpy(p, hdr, 80);
+	p += 80;
+
+	hash_hex = bin2hex(tmpl->aux.hash, 32);
+	auxpow_hex = bin2hex(auxpow, p - auxpow);
+	if (likely(hash_hex && auxpow_hex)) {
+		req = malloc(strlen(auxpow_hex) + 192);
+		if (likely(req))
+			sprintf(req, "{\"method\": \"getauxblock\", \"params\": [ \"%s\", \"%s\" ], \"id\":1}\r\n",
+				hash_hex, auxpow_hex);
+	}
+	free(hash_hex);
+	free(auxpow_hex);
+	free(auxpow);
+	return req;
+}
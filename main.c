@@ -38,7 +38,6 @@
 #include "findnonce.h"
 #include "bench_block.h"
 #include "ocl.h"
-#include "uthash.h"
 #include "adl.h"
 
 #if defined(unix)
@@ -94,6 +93,14 @@ struct workio_cmd {
 		struct work	*work;
 	} u;
 	bool			lagging;
+
+	struct pool		*pool;		/* pool the request is made to */
+	int			attempts;	/* quick getwork retries */
+	int			failures;
+	struct timeval		due;		/* earliest (re)try */
+	struct timeval		tv_sent;	/* last attempt started */
+	struct list_head	list;		/* io_pending or io_completed */
+	bool			finished;
 };
 
 enum sha256_algos {
@@ -105,6 +112,10 @@ enum sha256_algos {
 	ALGO_SSE2_32,		/* SSE2 for x86_32 */
 	ALGO_SSE2_64,		/* SSE2 for x86_64 */
 	ALGO_SSE4_64,		/* SSE4 for x86_64 */
+	ALGO_AVX2_8WAY,		/* parallel AVX2 */
+	ALGO_AVX512_16WAY,	/* parallel AVX-512 */
+	ALGO_SHANI,		/* x86 SHA extensions */
+	ALGO_C_PRECALC,		/* C with nonce-invariant precalc */
 };
 
 enum pool_strategy {
@@ -148,6 +159,16 @@ static const char *algo_names[] = {
 #ifdef WANT_X8664_SSE4
 	[ALGO_SSE4_64]		= "sse4_64",
 #endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= "avx2_8way",
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= "avx512_16way",
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= "shani",
+#endif
+	[ALGO_C_PRECALC]	= "c_precalc",
 };
 
 typedef void (*sha256_func)();
@@ -170,10 +191,61 @@ static const sha256_func sha256_funcs[] = {
 	[ALGO_SSE2_64]		= (sha256_func)scanhash_sse2_64,
 #endif
 #ifdef WANT_X8664_SSE4
-	[ALGO_SSE4_64]		= (sha256_func)scanhash_sse4_64
+	[ALGO_SSE4_64]		= (sha256_func)scanhash_sse4_64,
 #endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= (sha256_func)ScanHash_8WayAVX2,
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= (sha256_func)ScanHash_16WayAVX512,
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= (sha256_func)scanhash_shani,
+#endif
+	[ALGO_C_PRECALC]	= (sha256_func)scanhash_c_precalc,
+};
+
+/* CPU features each algorithm needs at runtime, see cpu_features() */
+static const unsigned int algo_cpu_features[ARRAY_SIZE(algo_names)] = {
+	[ALGO_4WAY]		= CPU_SSE2,
+	[ALGO_SSE2_32]		= CPU_SSE2,
+	[ALGO_SSE2_64]		= CPU_SSE2,
+	[ALGO_SSE4_64]		= CPU_SSE4_1,
+	[ALGO_AVX2_8WAY]	= CPU_AVX2,
+	[ALGO_AVX512_16WAY]	= CPU_AVX512,
+	[ALGO_SHANI]		= CPU_SHA,
+};
+
+static bool algo_supported(enum sha256_algos algo)
+{
+	unsigned int need = algo_cpu_features[algo];
+
+	return algo_names[algo] && (cpu_features() & need) == need;
+}
+
+/* Fastest kernels first, for when --algo isn't given */
+static const enum sha256_algos algo_preference[] = {
+	ALGO_SHANI,
+	ALGO_AVX512_16WAY,
+	ALGO_AVX2_8WAY,
+	ALGO_SSE4_64,
+	ALGO_SSE2_64,
+	ALGO_4WAY,
+	ALGO_SSE2_32,
 };
 
+/* The best kernel this binary has that this CPU can run */
+static enum sha256_algos best_algo(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(algo_preference); i++) {
+		if (algo_supported(algo_preference[i]))
+			return algo_preference[i];
+	}
+	return ALGO_C;
+}
+
 static char packagename[255];
 
 bool opt_debug = false;
@@ -187,24 +259,29 @@ static bool opt_realquiet = false;
 static bool opt_loginput = false;
 static int opt_retries = -1;
 static int opt_fail_pause = 5;
-static int fail_pause = 5;
+static int opt_pool_io_limit = 4;
 static int opt_log_interval = 5;
 bool opt_log_output = false;
 static bool opt_dynamic = true;
 static int opt_queue = 1;
+static bool opt_gbt;
+static unsigned char gbt_script[64];
+static size_t gbt_script_len;
+
+/* Merged mining: the aux chain daemon gets a pool of its own that is never
+ * mined from, and its pool_lock guards the block it last handed out */
+static struct pool aux_pool;
+static struct aux_block aux_block;
+static int total_aux_accepted, total_aux_rejected;
+
+#define AUX_POLL	5	/* seconds between getauxblock calls */
 int opt_vectors;
 int opt_worksize;
 int opt_scantime = 60;
 int opt_bench_algo = -1;
 static const bool opt_time = true;
 static bool opt_restart = true;
-#if defined(WANT_X8664_SSE2) && defined(__SSE2__)
-static enum sha256_algos opt_algo = ALGO_SSE2_64;
-#elif defined(WANT_X8632_SSE2) && defined(__SSE2__)
-static enum sha256_algos opt_algo = ALGO_SSE2_32;
-#else
-static enum sha256_algos opt_algo = ALGO_C;
-#endif
+static enum sha256_algos opt_algo = ALGO_C;	/* see best_algo() */
 static int nDevs;
 static int opt_g_threads = 2;
 static int opt_device;
@@ -213,6 +290,12 @@ static bool gpu_devices[MAX_GPUDEVICES];
 static int gpu_threads;
 static bool forced_n_threads;
 static int opt_n_threads;
+static bool opt_algo_auto;
+static bool opt_algo_rebench;
+#ifdef WANT_SSE2_4WAY
+static bool opt_lane_pack;
+#endif
+static char *opt_algo_cache;
 static int mining_threads;
 static int num_processors;
 static int scan_intensity;
@@ -235,6 +318,7 @@ struct thr_info *thr_info;
 static int work_thr_id;
 int longpoll_thr_id;
 static int stage_thr_id;
+static int aux_thr_id;
 static int watchdog_thr_id;
 static int input_thr_id;
 static int gpur_thr_id;
@@ -266,7 +350,6 @@ enum block_change {
 	BLOCK_FIRST,
 };
 
-static enum block_change block_changed = BLOCK_FIRST;
 static unsigned int local_work;
 static unsigned int total_go, total_ro;
 
@@ -278,20 +361,81 @@ static int total_pools;
 static enum pool_strategy pool_strategy = POOL_FAILOVER;
 static int opt_rotate_period;
 static int total_urls, total_users, total_passes, total_userpasses;
+static int total_chain_tags;
 
 static bool curses_active = false;
 
-static char current_block[37];
-static char *current_hash;
 static char datestamp[40];
-static char blocktime[30];
 
 struct block {
-	char hash[37];
-	UT_hash_handle hh;
+	unsigned char hash[32];		/* previous block hash, as in work->data */
+	unsigned int epoch;
+	struct list_head staged;	/* staged work for this block */
+	struct list_head list;		/* blocks, newest first */
+};
+
+/* Blocks seen recently; work from anything older is simply stale */
+#define BLOCK_HISTORY	16
+
+/*
+ * Pools mining different coins see different blocks, so each chain keeps
+ * its own.  Pools are on chains[0] unless --chain puts them elsewhere.
+ */
+struct chain {
+	char *name;
+	struct list_head blocks;	/* newest first */
+	int nr_blocks;
+	struct block *current;
+	unsigned int epoch;		/* current->epoch */
+	enum block_change changed;
+	char *hash;			/* current block, for display */
+	char blocktime[30];
 };
 
-static struct block *blocks = NULL;
+static struct chain chains[MAX_POOLS];
+static int total_chains;
+
+static void init_chain(struct chain *chain, const char *name)
+{
+	struct block *block;
+
+	block = calloc(sizeof(struct block), 1);
+	chain->name = strdup(name);
+	if (unlikely(!block || !chain->name))
+		quit(1, "init_chain OOM");
+	INIT_LIST_HEAD(&block->staged);
+	INIT_LIST_HEAD(&chain->blocks);
+	list_add(&block->list, &chain->blocks);
+	chain->nr_blocks = 1;
+	chain->current = block;
+	chain->changed = BLOCK_FIRST;
+}
+
+/* Chains are made as pools name them, only while parsing options */
+static struct chain *find_chain(const char *name)
+{
+	int i;
+
+	for (i = 0; i < total_chains; i++) {
+		if (!strcmp(chains[i].name, name))
+			return &chains[i];
+	}
+	if (total_chains == MAX_POOLS)
+		return NULL;
+	init_chain(&chains[total_chains], name);
+	return &chains[total_chains++];
+}
+
+static inline struct chain *work_chain(const struct work *work)
+{
+	return work->pool ? work->pool->chain : &chains[0];
+}
+
+/* work_restart[].chains bit for work's chain */
+static inline unsigned long chain_bit(const struct work *work)
+{
+	return 1UL << (work_chain(work) - chains);
+}
 
 static char *opt_kernel = NULL;
 
@@ -308,9 +452,14 @@ struct sigaction termhandler, inthandler;
 struct thread_q *getq;
 
 static int total_work;
-struct work *staged_work = NULL;
+static LIST_HEAD(staged_work);
+static int staged_count;
 static int staged_clones;
 
+/* Getwork prefetch depth, sized by queue_control() */
+static int queue_depth;
+static double getwork_latency;
+
 struct schedtime {
 	bool enable;
 	struct tm tm;
@@ -411,6 +560,7 @@ static void add_pool(void)
 		exit (1);
 	}
 	pool->pool_no = pool->prio = total_pools;
+	pool->chain = &chains[0];
 	pools[total_pools++] = pool;
 	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL))) {
 		applog(LOG_ERR, "Failed to pthread_mutex_init in add_pool");
@@ -453,68 +603,145 @@ static struct pool *current_pool(void)
 	return pool;
 }
 
-// Algo benchmark, crash-prone, system independent stage
-static double bench_algo_stage3(
-	enum sha256_algos algo
-)
+/*
+ * The benchmark runs the kernel on every planned mining thread at once for
+ * BENCH_LOAD_SECS and ranks by the aggregate rate, since what wins on an
+ * idle core is not always what wins with all cores and SMT siblings busy.
+ */
+#define BENCH_LOAD_SECS	3
+#define BENCH_CHUNK	(1 << 18)
+
+struct bench_thr {
+	pthread_t		pth;
+	enum sha256_algos	algo;
+	int			thr_id;
+	volatile bool		*stop;
+	uint64_t		hashes;
+};
+
+static void bench_work_init(struct work *work)
 {
 	// Use a random work block pulled from a pool
 	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
-	struct work work __attribute__((aligned(128)));
 
-	size_t bench_size = sizeof(work);
+	size_t bench_size = sizeof(*work);
 	size_t work_size = sizeof(bench_block);
 	size_t min_size = (work_size < bench_size ? work_size : bench_size);
-	memset(&work, 0, sizeof(work));
-	memcpy(&work, &bench_block, min_size);
+	memset(work, 0, sizeof(*work));
+	memcpy(work, &bench_block, min_size);
+}
+
+static void bench_scan(enum sha256_algos algo, int thr_id, struct work *work,
+		       uint32_t max_nonce, unsigned long *hashes_done)
+{
+	#if defined(WANT_VIA_PADLOCK)
 
-	struct work_restart dummy;
-	work_restart = &dummy;
+		// For some reason, the VIA padlock hasher has a different API ...
+		if (ALGO_VIA==algo) {
+			(void)scanhash_via(
+				thr_id,
+				work->data,
+				work->target,
+				max_nonce,
+				hashes_done,
+				work->blk.nonce
+			);
+		} else
+	#endif
+		{
+			sha256_func func = sha256_funcs[algo];
+			(*func)(
+				thr_id,
+				work->midstate,
+				work->data + 64,
+				work->hash1,
+				work->hash,
+				work->target,
+				max_nonce,
+				hashes_done,
+				work->blk.nonce
+			);
+		}
+}
+
+static void *bench_thread(void *userdata)
+{
+	struct bench_thr *bt = userdata;
+	struct work work __attribute__((aligned(128)));
+	uint32_t nonce = 0;
+
+	bench_work_init(&work);
+
+	while (!*bt->stop) {
+		unsigned long hashes_done = 0;
+
+		work.blk.nonce = nonce;
+		bench_scan(bt->algo, bt->thr_id, &work, nonce + BENCH_CHUNK, &hashes_done);
+
+		// Kernels report the nonce they reached, possibly early on a share
+		if (hashes_done > nonce)
+			bt->hashes += hashes_done - nonce;
+		nonce = hashes_done + 1;
+		if (nonce > 0xffffffff - BENCH_CHUNK)
+			nonce = 0;
+	}
+	return NULL;
+}
+
+// Algo benchmark, crash-prone, system independent stage
+static double bench_algo_stage3(
+	enum sha256_algos algo,
+	int threads
+)
+{
+	volatile bool stop = false;
+	struct bench_thr *bt;
+	uint64_t hashes = 0;
+	int i, started;
+
+	if (threads < 1)
+		threads = 1;
+
+	bt = calloc(threads, sizeof(*bt));
+	work_restart = calloc(threads, sizeof(*work_restart));
+	if (!bt || !work_restart) {
+		perror("calloc failed");
+		exit(1);
+	}
 
 	struct timeval end;
 	struct timeval start;
-	uint32_t max_nonce = (1<<22);
-	unsigned long hashes_done = 0;
 
 	gettimeofday(&start, 0);
-		#if defined(WANT_VIA_PADLOCK)
-
-			// For some reason, the VIA padlock hasher has a different API ...
-			if (ALGO_VIA==algo) {
-				(void)scanhash_via(
-					0,
-					work.data,
-					work.target,
-					max_nonce,
-					&hashes_done,
-					work.blk.nonce
-				);
-			} else
-		#endif
-			{
-				sha256_func func = sha256_funcs[algo];
-				(*func)(
-					0,
-					work.midstate,
-					work.data + 64,
-					work.hash1,
-					work.hash,
-					work.target,
-					max_nonce,
-					&hashes_done,
-					work.blk.nonce
-				);
-			}
+	for (started = 0; started < threads; started++) {
+		bt[started].algo = algo;
+		bt[started].thr_id = started;
+		bt[started].stop = &stop;
+		if (pthread_create(&bt[started].pth, NULL, bench_thread, &bt[started]))
+			break;
+	}
+
+	sleep(BENCH_LOAD_SECS);
+	stop = true;
+	for (i = 0; i < started; i++)
+		work_restart[i].restart = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(bt[i].pth, NULL);
+		hashes += bt[i].hashes;
+	}
 	gettimeofday(&end, 0);
+
+	free(work_restart);
 	work_restart = NULL;
+	free(bt);
 
 	uint64_t usec_end = ((uint64_t)end.tv_sec)*1000*1000 + end.tv_usec;
 	uint64_t usec_start = ((uint64_t)start.tv_sec)*1000*1000 + start.tv_usec;
 	uint64_t usec_elapsed = usec_end - usec_start;
 
 	double rate = -1.0;
-	if (0<usec_elapsed) {
-		rate = (1.0*hashes_done)/usec_elapsed;
+	if (started && 0<usec_elapsed) {
+		rate = (1.0*hashes)/usec_elapsed;
 	}
 	return rate;
 }
@@ -589,7 +816,7 @@ static double bench_algo_stage2(
 			// TODO: some umask trickery to prevent coredumps
 
 			// Benchmark this algorithm
-			double r = bench_algo_stage3(algo);
+			double r = bench_algo_stage3(algo, opt_n_threads);
 
 			// We survived, send result to parent and bail
 			int loop_count = 0;
@@ -718,7 +945,7 @@ static double bench_algo_stage2(
 
 		// Construct new command line based on that
 		char *p = strlen(cmd_line) + cmd_line;
-		sprintf(p, " --bench-algo %d", algo);
+		sprintf(p, " --bench-algo %d -t %d", algo, opt_n_threads);
 		SetEnvironmentVariable("CGMINER_BENCH_ALGO", "1");
 
 		// Launch a debug copy of cgminer
@@ -798,7 +1025,7 @@ static double bench_algo_stage2(
 	#else
 
 		// Not linux, not unix, not WIN32 ... do our best
-		rate = bench_algo_stage3(algo);
+		rate = bench_algo_stage3(algo, opt_n_threads);
 
 	#endif // defined(unix)
 
@@ -866,39 +1093,25 @@ static void init_max_name_len()
 }
 
 // Pick the fastest CPU hasher
-static enum sha256_algos pick_fastest_algo()
+static enum sha256_algos pick_fastest_algo(double *rate)
 {
 	double best_rate = -1.0;
 	enum sha256_algos best_algo = 0;
-	applog(LOG_ERR, "benchmarking all sha256 algorithms ...");
-
-	bench_algo(&best_rate, &best_algo, ALGO_C);
-
-	#if defined(WANT_SSE2_4WAY)
-		bench_algo(&best_rate, &best_algo, ALGO_4WAY);
-	#endif
-
-	#if defined(WANT_VIA_PADLOCK)
-		bench_algo(&best_rate, &best_algo, ALGO_VIA);
-	#endif
-
-	bench_algo(&best_rate, &best_algo, ALGO_CRYPTOPP);
-
-	#if defined(WANT_CRYPTOPP_ASM32)
-		bench_algo(&best_rate, &best_algo, ALGO_CRYPTOPP_ASM32);
-	#endif
-
-	#if defined(WANT_X8632_SSE2)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE2_32);
-	#endif
+	enum sha256_algos i;
 
-	#if defined(WANT_X8664_SSE2)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE2_64);
-	#endif
+	applog(LOG_ERR, "benchmarking all sha256 algorithms on %d threads ...",
+	       opt_n_threads);
 
-	#if defined(WANT_X8664_SSE4)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE4_64);
-	#endif
+	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
+		if (!algo_names[i])
+			continue;
+		if (!algo_supported(i)) {
+			applog(LOG_ERR, "\"%s\" : not supported by this CPU, skipping",
+			       algo_names[i]);
+			continue;
+		}
+		bench_algo(&best_rate, &best_algo, i);
+	}
 
 	size_t n = max_name_len - strlen(algo_names[best_algo]);
 	memset(name_spaces_pad, ' ', n);
@@ -910,21 +1123,164 @@ static enum sha256_algos pick_fastest_algo()
 		name_spaces_pad,
 		best_rate
 	);
+	*rate = best_rate;
 	return best_algo;
 }
 
+/* The CPU model and microcode revision as the kernel reports them */
+static void get_cpu_ident(char *model, size_t model_len, char *ucode, size_t ucode_len)
+{
+	char line[256];
+	FILE *f;
+
+	snprintf(model, model_len, "unknown");
+	snprintf(ucode, ucode_len, "unknown");
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *val = strchr(line, ':');
+
+		if (!val)
+			continue;
+		val++;
+		val += strspn(val, " \t");
+		val[strcspn(val, "\r\n")] = '\0';
+
+		if (!strncmp(line, "model name", 10))
+			snprintf(model, model_len, "%s", val);
+		else if (!strncmp(line, "microcode", 9))
+			snprintf(ucode, ucode_len, "%s", val);
+		else if (!strncmp(line, "processor", 9) && strcmp(val, "0"))
+			break;
+	}
+	fclose(f);
+}
+
+static const char *algo_cache_path(void)
+{
+	static char path[PATH_MAX];
+	const char *home;
+
+	if (opt_algo_cache)
+		return opt_algo_cache;
+
+	home = getenv("HOME");
+	if (!home || !*home)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/.cgminer-algo-cache", home);
+	return path;
+}
+
+/* The cached result is only good for the exact CPU, binary and thread count */
+static json_t *algo_cache_key(void)
+{
+	char model[128], ucode[32];
+	json_t *key = json_object();
+
+	get_cpu_ident(model, sizeof(model), ucode, sizeof(ucode));
+	json_object_set_new(key, "cpu", json_string(model));
+	json_object_set_new(key, "microcode", json_string(ucode));
+	json_object_set_new(key, "features", json_integer(cpu_features()));
+	json_object_set_new(key, "version", json_string(packagename));
+	json_object_set_new(key, "threads", json_integer(opt_n_threads));
+	return key;
+}
+
+static bool load_algo_cache(const char *path, json_t *key,
+			    enum sha256_algos *algo, double *rate)
+{
+	json_t *cache, *val;
+	json_error_t err;
+	const char *name;
+	bool ret = false;
+	void *it;
+	size_t i;
+
+	cache = json_load_file(path, 0, &err);
+	if (!json_is_object(cache))
+		goto out;
+
+	for (it = json_object_iter(key); it; it = json_object_iter_next(key, it)) {
+		val = json_object_get(cache, json_object_iter_key(it));
+		if (!json_equal(json_object_iter_value(it), val))
+			goto out;
+	}
+
+	name = json_string_value(json_object_get(cache, "algo"));
+	val = json_object_get(cache, "rate");
+	if (!name || !json_is_real(val))
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
+		if (algo_names[i] && !strcmp(name, algo_names[i]) && algo_supported(i)) {
+			*algo = i;
+			*rate = json_real_value(val);
+			ret = true;
+			break;
+		}
+	}
+out:
+	if (cache)
+		json_decref(cache);
+	return ret;
+}
+
+static void save_algo_cache(const char *path, json_t *key,
+			    enum sha256_algos algo, double rate)
+{
+	json_t *cache = json_copy(key);
+
+	json_object_set_new(cache, "algo", json_string(algo_names[algo]));
+	json_object_set_new(cache, "rate", json_real(rate));
+	if (json_dump_file(cache, path, JSON_INDENT(4)))
+		applog(LOG_WARNING, "Failed to write --algo auto cache %s", path);
+	json_decref(cache);
+}
+
+/* --algo auto, reusing the last benchmark on this host when nothing changed */
+static enum sha256_algos pick_algo_auto(void)
+{
+	const char *path = algo_cache_path();
+	enum sha256_algos algo;
+	json_t *key = NULL;
+	double rate;
+
+	if (path) {
+		key = algo_cache_key();
+		if (!opt_algo_rebench && load_algo_cache(path, key, &algo, &rate)) {
+			applog(LOG_WARNING, "Using cached --algo auto result from %s: %s at %.5f MH/s",
+			       path, algo_names[algo], rate);
+			goto out;
+		}
+	}
+
+	algo = pick_fastest_algo(&rate);
+	if (path && rate > 0.0)
+		save_algo_cache(path, key, algo, rate);
+out:
+	if (key)
+		json_decref(key);
+	return algo;
+}
+
 /* FIXME: Use asprintf for better errors. */
 static char *set_algo(const char *arg, enum sha256_algos *algo)
 {
 	enum sha256_algos i;
 
+	/* Benchmarked once the thread count is known, see pick_algo_auto() */
 	if (!strcmp(arg, "auto")) {
-		*algo = pick_fastest_algo();
+		opt_algo_auto = true;
 		return NULL;
 	}
 
 	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
 		if (algo_names[i] && !strcmp(arg, algo_names[i])) {
+			if (!algo_supported(i))
+				return "Algorithm not supported by this CPU";
 			*algo = i;
 			return NULL;
 		}
@@ -976,6 +1332,11 @@ static char *set_int_1_to_10(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 10);
 }
 
+static char *set_int_1_to_64(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 64);
+}
+
 static char *set_devices(const char *arg, int *i)
 {
 	char *err = opt_set_intval(arg, i);
@@ -990,6 +1351,14 @@ static char *set_devices(const char *arg, int *i)
 	return NULL;
 }
 
+static char *set_coinbase_addr(char *arg)
+{
+	if (!gbt_payout_script(arg, gbt_script, &gbt_script_len))
+		return "Invalid coinbase address";
+	opt_gbt = true;
+	return NULL;
+}
+
 static char *set_loadbalance(enum pool_strategy *strategy)
 {
 	*strategy = POOL_LOADBALANCE;
@@ -1018,8 +1387,9 @@ static char *set_url(char *arg)
 	pool = pools[total_urls - 1];
 
 	opt_set_charp(arg, &pool->rpc_url);
+	pool->has_stratum = !strncmp(arg, "stratum+tcp://", 14);
 	if (strncmp(arg, "http://", 7) &&
-	    strncmp(arg, "https://", 8)) {
+	    strncmp(arg, "https://", 8) && !pool->has_stratum) {
 		char *httpinput;
 
 		httpinput = malloc(255);
@@ -1081,6 +1451,22 @@ static char *set_userpass(const char *arg)
 	return NULL;
 }
 
+static char *set_chain(const char *arg)
+{
+	struct pool *pool;
+
+	total_chain_tags++;
+	if (total_chain_tags > total_pools)
+		add_pool();
+
+	pool = pools[total_chain_tags - 1];
+	pool->chain = find_chain(arg);
+	if (!pool->chain)
+		return "Too many chains";
+
+	return NULL;
+}
+
 static char *set_vector(const char *arg, int *i)
 {
 	char *err = opt_set_intval(arg, i);
@@ -1404,7 +1790,23 @@ static struct opt_table opt_config_table[] = {
 #ifdef WANT_X8664_SSE4
 		     "\n\tsse4_64\t\tSSE4.1 64 bit implementation for x86_64 machines"
 #endif
+#ifdef WANT_AVX2_8WAY
+		     "\n\tavx2_8way\t8-way AVX2 implementation"
+#endif
+#ifdef WANT_AVX512_16WAY
+		     "\n\tavx512_16way\t16-way AVX-512 implementation"
+#endif
+#ifdef WANT_SHANI
+		     "\n\tshani\t\tx86 SHA extensions implementation"
+#endif
+		     "\n\tc_precalc\tC with nonce-invariant precalc and early exit"
 		),
+	OPT_WITH_ARG("--algo-cache",
+		     opt_set_charp, NULL, &opt_algo_cache,
+		     "File to cache --algo auto results in (default: ~/.cgminer-algo-cache)"),
+	OPT_WITHOUT_ARG("--algo-rebench",
+			opt_set_bool, &opt_algo_rebench,
+			"Ignore any cached --algo auto result and benchmark again"),
 #ifdef HAVE_ADL
 	OPT_WITHOUT_ARG("--auto-fan",
 			opt_set_bool, &opt_autofan,
@@ -1413,9 +1815,21 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_autoengine,
 			"Automatically adjust all GPU engine clock speeds to maintain a target temperature"),
 #endif
+	OPT_WITH_ARG("--aux-url",
+		     opt_set_charp, NULL, &aux_pool.rpc_url,
+		     "Merged mine the aux chain whose getauxblock is at this URL, with --coinbase-addr"),
+	OPT_WITH_ARG("--aux-userpass",
+		     opt_set_charp, NULL, &aux_pool.rpc_userpass,
+		     "Username:Password pair for the --aux-url daemon"),
 	OPT_WITH_ARG("--bench-algo|-b",
 		     set_int_0_to_9999, opt_show_intval, &opt_bench_algo,
 		     opt_hidden),
+	OPT_WITH_ARG("--chain",
+		     set_chain, NULL, NULL,
+		     "Name the chain (coin) a pool mines, pools on the same chain share block tracking"),
+	OPT_WITH_ARG("--coinbase-addr",
+		     set_coinbase_addr, NULL, NULL,
+		     "Mine from getblocktemplate, building work locally with a coinbase paying this address"),
 	OPT_WITH_ARG("--cpu-threads|-t",
 		     force_nthreads_int, opt_show_intval, &opt_n_threads,
 		     "Number of miner CPU threads"),
@@ -1464,6 +1878,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--kernel|-k",
 		     opt_set_charp, NULL, &opt_kernel,
 		     "Select kernel to use (poclbm or phatk - default: auto)"),
+#endif
+#ifdef WANT_SSE2_4WAY
+	OPT_WITHOUT_ARG("--lane-pack",
+			opt_set_bool, &opt_lane_pack,
+			"Give each 4way SIMD lane its own work item instead of splitting one"),
 #endif
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
@@ -1483,7 +1902,7 @@ static struct opt_table opt_config_table[] = {
 #endif
 	OPT_WITHOUT_ARG("--no-longpoll",
 			opt_set_invbool, &want_longpoll,
-			"Disable X-Long-Polling support"),
+			"Disable X-Long-Polling and getblocktemplate long poll support"),
 #ifdef HAVE_OPENCL
 	OPT_WITHOUT_ARG("--no-restart",
 			opt_set_invbool, &opt_restart,
@@ -1495,12 +1914,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--per-device-stats",
 			opt_set_bool, &want_per_device_stats,
 			"Force verbose mode and output per-device statistics"),
+	OPT_WITH_ARG("--pool-io-limit",
+		     set_int_1_to_64, opt_show_intval, &opt_pool_io_limit,
+		     "Maximum getwork and submit requests in flight to any one pool (1 - 64)"),
 	OPT_WITHOUT_ARG("--protocol-dump|-P",
 			opt_set_bool, &opt_protocol,
 			"Verbose dump of protocol-level activities"),
 	OPT_WITH_ARG("--queue|-Q",
 		     set_int_0_to_10, opt_show_intval, &opt_queue,
-		     "Minimum number of work items to have queued (0 - 10)"),
+		     "Extra work items to queue beyond the adaptive depth (0 - 10)"),
 	OPT_WITHOUT_ARG("--quiet|-q",
 			opt_set_bool, &opt_quiet,
 			"Disable logging output, display status and errors"),
@@ -1558,7 +1980,7 @@ static struct opt_table opt_config_table[] = {
 			"Disable ncurses formatted screen output"),
 	OPT_WITH_ARG("--url|-o",
 		     set_url, NULL, NULL,
-		     "URL for bitcoin JSON-RPC server"),
+		     "URL for bitcoin JSON-RPC server, or stratum+tcp://host:port for a stratum pool"),
 	OPT_WITH_ARG("--user|-u",
 		     set_user, NULL, NULL,
 		     "Username for bitcoin JSON-RPC server"),
@@ -1737,6 +2159,48 @@ err_out:
 	return false;
 }
 
+/* Make tmpl pool's newest block template and fill work from it */
+static void pool_add_tmpl(struct pool *pool, struct gbt_tmpl *tmpl, struct work *work)
+{
+	struct gbt_tmpl *old;
+
+	mutex_lock(&pool->pool_lock);
+	tmpl->id = ++pool->tmpl_id;
+	old = pool->tmpl[tmpl->id % GBT_KEEP];
+	pool->tmpl[tmpl->id % GBT_KEEP] = tmpl;
+	gbt_work(tmpl, work);
+	mutex_unlock(&pool->pool_lock);
+	gbt_free(old);
+}
+
+/* Turn a getwork or getblocktemplate result from pool into work */
+static bool pool_decode(struct pool *pool, const json_t *res, struct work *work)
+{
+	struct gbt_tmpl *tmpl;
+	struct aux_block aux;
+
+	if (!opt_gbt)
+		return work_decode(res, work);
+
+	mutex_lock(&aux_pool.pool_lock);
+	aux = aux_block;
+	mutex_unlock(&aux_pool.pool_lock);
+	tmpl = gbt_decode(res, gbt_script, gbt_script_len, aux.id ? &aux : NULL);
+	if (unlikely(!tmpl))
+		return false;
+
+	/* A node long polls by longpollid rather than X-Long-Polling, at its
+	 * longpolluri or else its own URL */
+	if (tmpl->lp_id && !pool->hdr_path) {
+		mutex_lock(&pool->pool_lock);
+		if (!pool->hdr_path)
+			pool->hdr_path = strdup(tmpl->lp_uri ? tmpl->lp_uri : pool->rpc_url);
+		mutex_unlock(&pool->pool_lock);
+	}
+	pool_add_tmpl(pool, tmpl, work);
+	return true;
+}
+
 static inline int dev_from_id(int thr_id)
 {
 	return thr_info[thr_id].cgpu->cpu_gpu;
@@ -1767,7 +2231,7 @@ static int requests_staged(void)
 	int ret;
 
 	mutex_lock(stgd_lock);
-	ret = HASH_COUNT(staged_work);
+	ret = staged_count;
 	mutex_unlock(stgd_lock);
 	return ret;
 }
@@ -1852,6 +2316,7 @@ static void text_print_status(int thr_id)
 static void curses_print_status(void)
 {
 	struct pool *pool = current_pool();
+	struct chain *chain = pool->chain;
 
 	wattron(statuswin, A_BOLD);
 	mvwprintw(statuswin, 0, 0, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
@@ -1861,8 +2326,8 @@ static void curses_print_status(void)
 	mvwhline(statuswin, 1, 0, '-', 80);
 	mvwprintw(statuswin, 2, 0, " %s", statusline);
 	wclrtoeol(statuswin);
-	mvwprintw(statuswin, 3, 0, " TQ: %d  ST: %d  SS: %d  DW: %d  NB: %d  LW: %d  GF: %d  RF: %d  I: %d",
-		total_queued, requests_staged(), total_stale, total_discarded, new_blocks,
+	mvwprintw(statuswin, 3, 0, " TQ: %d/%d  ST: %d  SS: %d  DW: %d  NB: %d  LW: %d  GF: %d  RF: %d  I: %d",
+		total_queued, queue_depth, requests_staged(), total_stale, total_discarded, new_blocks,
 		local_work, total_go, total_ro, scan_intensity);
 	wclrtoeol(statuswin);
 	if (pool_strategy == POOL_LOADBALANCE && total_pools > 1)
@@ -1872,7 +2337,7 @@ static void curses_print_status(void)
 		mvwprintw(statuswin, 4, 0, " Connected to %s with%s LP as user %s",
 			pool->rpc_url, have_longpoll ? "": "out", pool->rpc_user);
 	wclrtoeol(statuswin);
-	mvwprintw(statuswin, 5, 0, " Block: %s...  Started: %s", current_hash, blocktime);
+	mvwprintw(statuswin, 5, 0, " Block: %s...  Started: %s", chain->hash, chain->blocktime);
 	mvwhline(statuswin, 6, 0, '-', 80);
 	mvwhline(statuswin, logstart - 1, 0, '-', 80);
 	mvwprintw(statuswin, gpucursor - 1, 1, "[P]ool management %s[S]ettings [D]isplay options [Q]uit",
@@ -2004,60 +2469,76 @@ static void clear_logwin(void)
 	}
 }
 
-static bool submit_upstream_work(const struct work *work)
+struct obj_pool work_pool = OBJ_POOL("work", struct work);
+static struct obj_pool workio_cmd_pool = OBJ_POOL("workio_cmd", struct workio_cmd);
+
+static struct work *make_work(void)
 {
-	char *hexstr = NULL;
-	json_t *val, *res;
-	char s[345], sd[345];
-	bool rc = false;
-	int thr_id = work->thr_id;
-	struct cgpu_info *cgpu = thr_info[thr_id].cgpu;
-	CURL *curl = curl_easy_init();
-	struct pool *pool = work->pool;
-	bool rolltime;
+	struct work *work = obj_alloc(&work_pool);
 
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return rc;
-	}
+	work->id = total_work++;
+	return work;
+}
 
-	/* build hex string */
-	hexstr = bin2hex(work->data, sizeof(work->data));
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "submit_upstream_work OOM");
-		goto out_nofree;
+static void free_work(struct work *work)
+{
+	obj_free(&work_pool, work);
+}
+
+static void workio_cmd_free(struct workio_cmd *wc)
+{
+	if (!wc)
+		return;
+
+	switch (wc->cmd) {
+	case WC_SUBMIT_WORK:
+		free_work(wc->u.work);
+		break;
+	default: /* do nothing */
+		break;
 	}
 
-	/* build JSON-RPC request */
-	sprintf(s,
-	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
-		hexstr);
-	sprintf(sd,
-	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}",
-		hexstr);
+	memset(wc, 0, sizeof(*wc));	/* poison */
+	obj_free(&workio_cmd_pool, wc);
+}
 
-	if (opt_debug)
-		applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, sd);
+static void io_done(struct workio_cmd *wc, bool ok);
 
-	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool);
-	if (unlikely(!val)) {
-		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
-		if (!pool_tset(pool, &pool->submit_fail)) {
-			total_ro++;
+static void submit_work_done(json_t *val, int rolltime, void *arg)
+{
+	struct workio_cmd *wc = arg;
+	const struct work *work = wc->u.work;
+	int thr_id = work->thr_id;
+	struct cgpu_info *cgpu = thr_info[thr_id].cgpu;
+	struct pool *pool = work->pool;
+	char *hexstr;
+	json_t *res;
+
+	if (unlikely(!val)) {
+		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
+		if (!pool_tset(pool, &pool->submit_fail)) {
+			total_ro++;
 			pool->remotefail_occasions++;
 			applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
 		}
-		goto out;
+		io_done(wc, false);
+		return;
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	/* just the nonce, for the log */
+	hexstr = bin2hex(work->data + 76, 4);
+	if (unlikely(!hexstr)) {
+		applog(LOG_ERR, "submit_work_done OOM");
+		goto out;
+	}
+
 	res = json_object_get(val, "result");
 
-	/* Theoretically threads could race when modifying accepted and
-	 * rejected values but the chance of two submits completing at the
-	 * same time is zero so there is no point adding extra locking */
-	if (json_is_true(res)) {
+	/* Every submit result is handled on the network thread so the
+	 * accepted and rejected counts need no locking.  submitblock
+	 * accepts with a null result and rejects with a reason */
+	if (json_is_true(res) || (work->tmpl_id && json_is_null(res))) {
 		cgpu->accepted++;
 		total_accepted++;
 		pool->accepted++;
@@ -2066,10 +2547,10 @@ static bool submit_upstream_work(const struct work *work)
 		if (!QUIET) {
 			if (total_pools > 1)
 				applog(LOG_WARNING, "Accepted %.8s %sPU %d thread %d pool %d",
-				       hexstr + 152, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id, work->pool->pool_no);
+				       hexstr, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id, work->pool->pool_no);
 			else
 				applog(LOG_WARNING, "Accepted %.8s %sPU %d thread %d",
-				       hexstr + 152, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id);
+				       hexstr, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id);
 		}
 		if (opt_shares && total_accepted >= opt_shares) {
 			applog(LOG_WARNING, "Successfully mined %d accepted shares as requested and exiting.", opt_shares);
@@ -2082,13 +2563,24 @@ static bool submit_upstream_work(const struct work *work)
 		pool->rejected++;
 		if (opt_debug)
 			applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
+		if (json_is_string(res))
+			applog(LOG_INFO, "Pool %d rejected block: %s", pool->pool_no,
+			       json_string_value(res));
+		else if (pool->has_stratum) {
+			/* stratum errors are [code, message, traceback] */
+			json_t *err = json_array_get(json_object_get(val, "error"), 1);
+
+			if (json_is_string(err))
+				applog(LOG_INFO, "Pool %d rejected share: %s", pool->pool_no,
+				       json_string_value(err));
+		}
 		if (!QUIET) {
 			if (total_pools > 1)
 				applog(LOG_WARNING, "Rejected %.8s %sPU %d thread %d pool %d",
-				       hexstr + 152, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id, work->pool->pool_no);
+				       hexstr, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id, work->pool->pool_no);
 			else
 				applog(LOG_WARNING, "Rejected %.8s %sPU %d thread %d",
-				       hexstr + 152, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id);
+				       hexstr, cgpu->is_gpu? "G" : "C", cgpu->cpu_gpu, thr_id);
 		}
 	}
 
@@ -2103,19 +2595,251 @@ static bool submit_upstream_work(const struct work *work)
 		applog(LOG_INFO, "%s", logline);
 	}
 
+out:
+	free(hexstr);
 	json_decref(val);
+	io_done(wc, true);
+}
+
+/* A share sent to a stratum pool, waiting on the response with its id */
+struct stratum_share {
+	int			id;
+	struct workio_cmd	*wc;
+	struct list_head	list;
+};
+
+/* Take the share waiting on response id off pool's list */
+static struct stratum_share *stratum_take_share(struct pool *pool, int id)
+{
+	struct stratum_share *sshare, *ret = NULL;
+
+	mutex_lock(&pool->pool_lock);
+	list_for_each_entry(sshare, &pool->stratum_shares, list) {
+		if (sshare->id == id) {
+			list_del(&sshare->list);
+			ret = sshare;
+			break;
+		}
+	}
+	mutex_unlock(&pool->pool_lock);
+	return ret;
+}
 
+/* Pipeline wc's share down its pool's stratum connection; the response is
+ * matched up by stratum_thread and handed on to submit_work_done */
+static bool submit_stratum_work(struct workio_cmd *wc)
+{
+	struct work *work = wc->u.work;
+	struct pool *pool = work->pool;
+	char *xnonce_hex, *ntime_hex, *nonce_hex, *job_id = NULL, *s = NULL;
+	struct stratum_share *sshare;
+	unsigned char xnonce[16];
+	struct gbt_tmpl *tmpl;
+	int xnonce_len = 0;
+	bool rc = false;
+
+	sshare = calloc(1, sizeof(*sshare));
+	if (unlikely(!sshare))
+		return false;
+	mutex_lock(&pool->pool_lock);
+	tmpl = pool->tmpl[work->tmpl_id % GBT_KEEP];
+	if (tmpl && tmpl->id == work->tmpl_id && tmpl->job_id) {
+		job_id = strdup(tmpl->job_id);
+		xnonce_len = tmpl->xnonce_len;
+	}
+	sshare->id = ++pool->stratum_id;
+	mutex_unlock(&pool->pool_lock);
+	if (!job_id) {
+		applog(LOG_INFO, "Stratum job for share no longer held");
+		total_stale++;
+		pool->stale_shares++;
+		free(sshare);
+		io_done(wc, true);
+		return true;
+	}
+
+	gbt_put_xnonce(xnonce, work->extranonce, xnonce_len);
+	xnonce_hex = bin2hex(xnonce, xnonce_len);
+	/* getwork order keeps ntime and the nonce as stratum writes them */
+	ntime_hex = bin2hex(work->data + 68, 4);
+	nonce_hex = bin2hex(work->data + 76, 4);
+	if (likely(xnonce_hex && ntime_hex && nonce_hex))
+		s = malloc(strlen(pool->rpc_user) + strlen(job_id) + 192);
+	if (unlikely(!s)) {
+		applog(LOG_ERR, "submit_stratum_work OOM");
+		goto out;
+	}
+	sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+		pool->rpc_user, job_id, xnonce_hex, ntime_hex, nonce_hex, sshare->id);
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s stratum submit: %s", pool->rpc_url, s);
+
+	sshare->wc = wc;
+	mutex_lock(&pool->pool_lock);
+	list_add_tail(&sshare->list, &pool->stratum_shares);
+	mutex_unlock(&pool->pool_lock);
 	rc = true;
+	/* unless losing the connection has failed the share already */
+	if (unlikely(!stratum_send(pool, s)) && stratum_take_share(pool, sshare->id))
+		rc = false;
+	else
+		sshare = NULL;
 out:
+	free(sshare);
+	free(xnonce_hex);
+	free(ntime_hex);
+	free(nonce_hex);
+	free(job_id);
+	free(s);
+	return rc;
+}
+
+static void submit_aux_done(json_t *val, int rolltime, void *arg)
+{
+	char *hexstr = arg;
+
+	/* counted on the network thread, as submit_work_done does */
+	if (val && json_is_true(json_object_get(val, "result"))) {
+		total_aux_accepted++;
+		applog(LOG_WARNING, "Aux chain accepted %.8s", hexstr);
+	} else {
+		total_aux_rejected++;
+		applog(LOG_WARNING, "Aux chain rejected %.8s", hexstr);
+	}
+	if (val)
+		json_decref(val);
+	free(hexstr);
+}
+
+/* Hand the auxpow in req to the aux chain, which answers in submit_aux_done */
+static void submit_aux_work(const struct work *work, const char *req)
+{
+	char *hexstr = bin2hex(work->data + 76, 4);
+
+	if (unlikely(!hexstr)) {
+		applog(LOG_ERR, "submit_aux_work OOM");
+		return;
+	}
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s getauxblock RPC call", aux_pool.rpc_url);
+	if (unlikely(!json_rpc_call_async(aux_pool.rpc_url, aux_pool.rpc_userpass, req,
+					  &aux_pool, POOL_CURL_SUBMIT, submit_aux_done, hexstr))) {
+		applog(LOG_ERR, "Failed to submit to aux chain");
+		free(hexstr);
+	}
+}
+
+/* Send wc's share to its pool; the result arrives in submit_work_done */
+static bool submit_upstream_work(struct workio_cmd *wc)
+{
+	const struct work *work = wc->u.work;
+	struct pool *pool = work->pool;
+	char s[345], sd[345];
+	char *hexstr;
+	bool rc;
+
+	if (pool->has_stratum)
+		return submit_stratum_work(wc);
+
+	if (work->tmpl_id) {
+		struct gbt_tmpl *tmpl;
+		char *req = NULL, *aux_req = NULL;
+		bool held = false;
+
+		/* A merged mined share is only as good as the targets it meets */
+		mutex_lock(&pool->pool_lock);
+		tmpl = pool->tmpl[work->tmpl_id % GBT_KEEP];
+		if (tmpl && tmpl->id == work->tmpl_id) {
+			held = true;
+			if (tmpl->aux.id && gbt_meets(work, tmpl->aux.target))
+				aux_req = gbt_auxpow_req(tmpl, work);
+			if (!aux_req || gbt_meets(work, tmpl->target))
+				req = gbt_submit_req(tmpl, work);
+		}
+		mutex_unlock(&pool->pool_lock);
+		if (unlikely(!held)) {
+			applog(LOG_INFO, "Block template for share no longer held");
+			total_stale++;
+			pool->stale_shares++;
+			io_done(wc, true);
+			return true;
+		}
+		if (aux_req) {
+			submit_aux_work(work, aux_req);
+			free(aux_req);
+		}
+		if (!req) {
+			io_done(wc, true);
+			return true;
+		}
+		if (opt_debug)
+			applog(LOG_DEBUG, "DBG: sending %s submitblock RPC call", pool->rpc_url);
+		rc = json_rpc_call_async(pool->rpc_url, pool->rpc_userpass, req, pool,
+					 POOL_CURL_SUBMIT, submit_work_done, wc);
+		free(req);
+		return rc;
+	}
+
+	/* build hex string */
+	hexstr = bin2hex(work->data, sizeof(work->data));
+	if (unlikely(!hexstr)) {
+		applog(LOG_ERR, "submit_upstream_work OOM");
+		return false;
+	}
+
+	/* build JSON-RPC request */
+	sprintf(s,
+	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
+		hexstr);
+	sprintf(sd,
+	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}",
+		hexstr);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, sd);
+
+	/* issue JSON-RPC request */
+	rc = json_rpc_call_async(pool->rpc_url, pool->rpc_userpass, s, pool,
+				 POOL_CURL_SUBMIT, submit_work_done, wc);
 	free(hexstr);
-out_nofree:
-	curl_easy_cleanup(curl);
 	return rc;
 }
 
 static const char *rpc_req =
 	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
 
+static const char *gbt_req =
+	"{\"method\": \"getblocktemplate\", \"params\": [{\"rules\": [\"segwit\"]}], \"id\":0}\r\n";
+
+/* The request that fetches new work from a pool */
+static inline const char *work_req(void)
+{
+	return opt_gbt ? gbt_req : rpc_req;
+}
+
+/* The long poll for pool's next work.  A getblocktemplate node holds it
+ * until the newest template we have from it is out of date */
+static char *work_lp_req(struct pool *pool)
+{
+	struct gbt_tmpl *tmpl;
+	char *req = NULL;
+
+	if (!opt_gbt)
+		return strdup(rpc_req);
+
+	mutex_lock(&pool->pool_lock);
+	tmpl = pool->tmpl[pool->tmpl_id % GBT_KEEP];
+	if (tmpl && tmpl->lp_id) {
+		req = malloc(strlen(tmpl->lp_id) + 128);
+		if (likely(req))
+			sprintf(req, "{\"method\": \"getblocktemplate\", \"params\": "
+				"[{\"rules\": [\"segwit\"], \"longpollid\": \"%s\"}], \"id\":0}\r\n",
+				tmpl->lp_id);
+	}
+	mutex_unlock(&pool->pool_lock);
+	return req;
+}
+
 /* Select any active pool in a rotating fashion when loadbalance is chosen */
 static inline struct pool *select_pool(bool lagging)
 {
@@ -2141,80 +2865,78 @@ static inline struct pool *select_pool(bool lagging)
 	return pool;
 }
 
-static bool get_upstream_work(struct work *work, bool lagging)
+/* An unlimited X-Roll-Ntime rolls for the scan time */
+static inline int roll_time(int rolltime)
 {
-	struct pool *pool;
-	json_t *val = NULL;
-	bool rc = false;
-	int retries = 0;
-	CURL *curl;
-
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return rc;
-	}
+	return rolltime < 0 ? opt_scantime : rolltime;
+}
 
-	pool = select_pool(lagging);
-	if (opt_debug)
-		applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
+static void get_work_done(json_t *val, int rolltime, void *arg)
+{
+	struct workio_cmd *wc = arg;
+	struct pool *pool = wc->pool;
+	struct timeval now, diff;
+	struct work *work;
 
-retry:
-	/* A single failure response here might be reported as a dead pool and
-	 * there may be temporary denied messages etc. falsely reporting
-	 * failure so retry a few times before giving up */
-	while (!val && retries++ < 3)
-		val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, rpc_req,
-			    false, false, &work->rolltime, pool);
 	if (unlikely(!val)) {
 		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
-		goto out;
+		io_done(wc, false);
+		return;
 	}
 
-	rc = work_decode(json_object_get(val, "result"), work);
-	if (!rc && retries < 3)
-		goto retry;
+	work = make_work();
+	if (unlikely(!pool_decode(pool, json_object_get(val, "result"), work))) {
+		json_decref(val);
+		free_work(work);
+		io_done(wc, false);
+		return;
+	}
+	json_decref(val);
+
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &wc->tv_sent);
+	decay_time(&getwork_latency, diff.tv_sec + diff.tv_usec / 1000000.0);
+
+	work->rolltime = roll_time(rolltime);
 	work->pool = pool;
+	work->thr = wc->thr;
 	total_getworks++;
 	pool->getwork_requested++;
 
-	json_decref(val);
-out:
-	curl_easy_cleanup(curl);
-
-	return rc;
-}
-
-static struct work *make_work(void)
-{
-	struct work *work = calloc(1, sizeof(struct work));
+	if (opt_debug)
+		applog(LOG_DEBUG, "Pushing work to requesting thread");
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
-	work->id = total_work++;
-	return work;
+	/* send work to requesting thread */
+	if (unlikely(!tq_push(thr_info[stage_thr_id].q, work))) {
+		applog(LOG_ERR, "Failed to tq_push work in get_work_done");
+		kill_work();
+		free_work(work);
+	}
+	io_done(wc, true);
 }
 
-static void free_work(struct work *work)
-{
-	free(work);
-}
+static void dec_queued(void);
+static bool gbt_stage(struct pool *pool);
 
-static void workio_cmd_free(struct workio_cmd *wc)
+/* Ask wc's pool for work; it arrives in get_work_done */
+static bool get_upstream_work(struct workio_cmd *wc)
 {
-	if (!wc)
-		return;
+	struct pool *pool = wc->pool;
 
-	switch (wc->cmd) {
-	case WC_SUBMIT_WORK:
-		free_work(wc->u.work);
-		break;
-	default: /* do nothing */
-		break;
+	/* There is no asking a stratum pool, only making work from its job */
+	if (pool->has_stratum) {
+		if (!gbt_stage(pool))
+			return false;
+		dec_queued();
+		io_done(wc, true);
+		return true;
 	}
 
-	memset(wc, 0, sizeof(*wc));	/* poison */
-	free(wc);
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, work_req());
+
+	return json_rpc_call_async(pool->rpc_url, pool->rpc_userpass, work_req(), pool,
+				   POOL_CURL_GETWORK, get_work_done, wc);
 }
 
 static void disable_curses(void)
@@ -2282,6 +3004,13 @@ void kill_work(void)
 	thr = &thr_info[longpoll_thr_id];
 	thr_info_cancel(thr);
 
+	if (aux_pool.rpc_url) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "Killing off aux thread");
+		thr = &thr_info[aux_thr_id];
+		thr_info_cancel(thr);
+	}
+
 	if (opt_debug)
 		applog(LOG_DEBUG, "Killing off work thread");
 	thr = &thr_info[work_thr_id];
@@ -2300,137 +3029,175 @@ static void sighandler(int sig)
 	quit(sig, "Received interrupt signal.");
 }
 
-static void *get_work_thread(void *userdata)
+/*
+ * getwork and share submission requests wait on io_pending, soonest due
+ * first, until their pool has fewer than opt_pool_io_limit requests in
+ * flight.  workio_thread starts them on the network thread and they come
+ * back to it through io_done, to be freed or queued again after a delay.
+ * Only workio_thread touches io_pending, pool->io_active and pool->io_submits.
+ *
+ * A dead pool's shares back up on io_pending, so each pool may only have
+ * POOL_MAX_SUBMITS of them there before new ones are discarded.
+ *
+ * Completions go on io_completed rather than through workio_thread's bounded
+ * queue, so a full queue can't lose one along with its pool's slot.
+ */
+#define POOL_MAX_SUBMITS 256
+
+static LIST_HEAD(io_pending);
+static LIST_HEAD(io_completed);
+static pthread_mutex_t io_completed_lock;
+static char io_wake;	/* queued to have workio_thread look at io_completed */
+
+static void io_queue(struct workio_cmd *wc)
 {
-	struct workio_cmd *wc = (struct workio_cmd *)userdata;
-	struct work *ret_work;
-	int failures = 0;
+	struct list_head *pos;
 
-	pthread_detach(pthread_self());
-	ret_work = make_work();
+	list_for_each_prev(pos, &io_pending) {
+		if (!timercmp(&list_entry(pos, struct workio_cmd, list)->due, &wc->due, >))
+			break;
+	}
+	list_add(&wc->list, pos);
+}
 
-	if (wc->thr)
-		ret_work->thr = wc->thr;
-	else
-		ret_work->thr = NULL;
+/* First request that may run now, else NULL with *next set to when one will
+ * be due (zeroed if everything due is waiting on a busy pool) */
+static struct workio_cmd *io_next(struct timeval *now, struct timeval *next)
+{
+	struct workio_cmd *wc;
 
-	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(ret_work, wc->lagging)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
-			free_work(ret_work);
-			kill_work();
-			goto out;
+	timerclear(next);
+	list_for_each_entry(wc, &io_pending, list) {
+		if (timercmp(&wc->due, now, >)) {
+			*next = wc->due;
+			break;
 		}
-
-		/* pause, then restart work-request loop */
-		applog(LOG_DEBUG, "json_rpc_call failed on get work, retry after %d seconds",
-			fail_pause);
-		sleep(fail_pause);
-		fail_pause += opt_fail_pause;
+		if (wc->pool->io_active < opt_pool_io_limit)
+			return wc;
 	}
-	fail_pause = opt_fail_pause;
+	return NULL;
+}
 
-	if (opt_debug)
-		applog(LOG_DEBUG, "Pushing work to requesting thread");
+/* Hand a completed request back to workio_thread, noting whether to retry */
+static void io_done(struct workio_cmd *wc, bool ok)
+{
+	bool wake;
 
-	/* send work to requesting thread */
-	if (unlikely(!tq_push(thr_info[stage_thr_id].q, ret_work))) {
-		applog(LOG_ERR, "Failed to tq_push work in workio_get_work");
+	wc->finished = ok;
+	if (ok)
+		goto out;
+
+	gettimeofday(&wc->due, NULL);
+
+	/* A single failure response to getwork might be a temporary denial
+	 * rather than a dead pool, so try a few times before backing off */
+	if (wc->cmd == WC_GET_WORK && ++wc->attempts < 3)
+		goto out;
+	wc->attempts = 0;
+
+	if (unlikely(opt_retries >= 0 && ++wc->failures > opt_retries)) {
+		applog(LOG_ERR, "Failed %d retries ...terminating workio thread", opt_retries);
+		wc->finished = true;
 		kill_work();
-		free_work(ret_work);
+		goto out;
 	}
+	if (opt_retries < 0)
+		wc->failures++;
 
+	if (wc->cmd == WC_GET_WORK)
+		applog(LOG_DEBUG, "json_rpc_call failed on get work, retry after %d seconds",
+			opt_fail_pause * wc->failures);
+	else
+		applog(LOG_INFO, "json_rpc_call failed on submit_work, retry after %d seconds",
+			opt_fail_pause * wc->failures);
+	wc->due.tv_sec += opt_fail_pause * wc->failures;
 out:
-	workio_cmd_free(wc);
-	return NULL;
+	mutex_lock(&io_completed_lock);
+	wake = list_empty(&io_completed);
+	list_add_tail(&wc->list, &io_completed);
+	mutex_unlock(&io_completed_lock);
+
+	/* One wakeup covers everything queued behind it, and if the queue is
+	 * full workio_thread has plenty to wake it anyway */
+	if (wake)
+		tq_push(thr_info[work_thr_id].q, &io_wake);
+}
+
+/* Free the completed requests or queue them to be tried again */
+static void io_reap(void)
+{
+	struct workio_cmd *wc, *tmp;
+	LIST_HEAD(done);
+
+	mutex_lock(&io_completed_lock);
+	list_splice_init(&io_completed, &done);
+	mutex_unlock(&io_completed_lock);
+
+	list_for_each_entry_safe(wc, tmp, &done, list) {
+		list_del(&wc->list);
+		wc->pool->io_active--;
+		if (wc->finished) {
+			if (wc->cmd == WC_SUBMIT_WORK)
+				wc->pool->io_submits--;
+			workio_cmd_free(wc);
+			continue;
+		}
+		/* the pool may have failed over in the meantime */
+		if (wc->cmd == WC_GET_WORK)
+			wc->pool = select_pool(wc->lagging);
+		io_queue(wc);
+	}
 }
 
-static bool workio_get_work(struct workio_cmd *wc)
+/* Rollable work lives for as long as the pool lets it be rolled */
+static inline int work_expiry(const struct work *work)
 {
-	pthread_t get_thread;
-
-	if (unlikely(pthread_create(&get_thread, NULL, get_work_thread, (void *)wc))) {
-		applog(LOG_ERR, "Failed to create get_work_thread");
-		return false;
-	}
-	return true;
+	return work->rolltime > opt_scantime ? work->rolltime : opt_scantime;
 }
 
 static bool stale_work(struct work *work)
 {
 	struct timeval now;
-	bool ret = false;
-	char *hexstr;
 
-	gettimeofday(&now, NULL);
-	if ((now.tv_sec - work->tv_staged.tv_sec) >= opt_scantime)
+	if (work->epoch != work_chain(work)->epoch)
 		return true;
 
-	hexstr = bin2hex(work->data, 18);
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "submit_work_thread OOM");
-		return ret;
-	}
-
-	if (strcmp(hexstr, current_block))
-		ret = true;
-
-	free(hexstr);
-	return ret;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - work->tv_staged.tv_sec) >= work_expiry(work);
 }
 
-static void *submit_work_thread(void *userdata)
+/* A stratum share holds for as long as its block does, the pool tells
+ * us itself which jobs it no longer takes.  So does a getblocktemplate
+ * solution, which is a whole block however old its work is */
+static bool stale_share(struct work *work)
 {
-	struct workio_cmd *wc = (struct workio_cmd *)userdata;
-	struct work *work = wc->u.work;
-	struct pool *pool = work->pool;
-	int failures = 0;
+	if (work->pool->has_stratum || work->tmpl_id)
+		return work->epoch != work_chain(work)->epoch;
+	return stale_work(work);
+}
 
-	pthread_detach(pthread_self());
+/* Start wc's request; it comes back through io_done */
+static void io_start(struct workio_cmd *wc)
+{
+	bool ok;
 
-	if (!opt_submit_stale && stale_work(work)) {
+	if (wc->cmd == WC_SUBMIT_WORK && !opt_submit_stale && stale_share(wc->u.work)) {
 		applog(LOG_WARNING, "Stale share detected, discarding");
 		total_stale++;
-		pool->stale_shares++;
-		goto out;
+		wc->pool->stale_shares++;
+		wc->pool->io_submits--;
+		workio_cmd_free(wc);
+		return;
 	}
 
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work)) {
-		if (!opt_submit_stale && stale_work(work)) {
-			applog(LOG_WARNING, "Stale share detected, discarding");
-			total_stale++;
-			pool->stale_shares++;
-			break;
-		}
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "Failed %d retries ...terminating workio thread", opt_retries);
-			kill_work();
-			break;
-		}
-
-		/* pause, then restart work-request loop */
-		applog(LOG_INFO, "json_rpc_call failed on submit_work, retry after %d seconds",
-			fail_pause);
-		sleep(fail_pause);
-		fail_pause += opt_fail_pause;
-	}
-	fail_pause = opt_fail_pause;
-out:
-	workio_cmd_free(wc);
-	return NULL;
-}
-
-static bool workio_submit_work(struct workio_cmd *wc)
-{
-	pthread_t submit_thread;
-
-	if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)wc))) {
-		applog(LOG_ERR, "Failed to create submit_work_thread");
-		return false;
-	}
-	return true;
+	wc->pool->io_active++;
+	gettimeofday(&wc->tv_sent, NULL);
+	if (wc->cmd == WC_GET_WORK)
+		ok = get_upstream_work(wc);
+	else
+		ok = submit_upstream_work(wc);
+	if (unlikely(!ok))
+		io_done(wc, false);
 }
 
 /* Find the pool that currently has the highest priority */
@@ -2562,21 +3329,51 @@ static int requests_queued(void)
 	return ret;
 }
 
-static int discard_stale(void)
+/* Must be called with stgd_lock held */
+static void unstage_work(struct work *work)
+{
+	list_del(&work->list);
+	list_del(&work->block_list);
+	staged_count--;
+	if (work->clone)
+		--staged_clones;
+}
+
+static int discard_stale(struct chain *chain)
 {
 	struct work *work, *tmp;
+	struct block *block;
+	struct timeval now;
 	int i, stale = 0;
 
+	gettimeofday(&now, NULL);
+
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work)) {
-			HASH_DEL(staged_work, work);
-			if (work->clone)
-				--staged_clones;
+	/* Everything staged under a block of this chain other than its
+	 * current one goes in one sweep of that block's list */
+	rd_lock(&blk_lock);
+	list_for_each_entry(block, &chain->blocks, list) {
+		if (block == chain->current)
+			continue;
+		list_for_each_entry_safe(work, tmp, &block->staged, block_list) {
+			unstage_work(work);
 			discard_work(work);
 			stale++;
 		}
 	}
+	rd_unlock(&blk_lock);
+
+	/* Then whatever has expired, oldest first; nothing younger than the
+	 * scan time can have */
+	list_for_each_entry_safe(work, tmp, &staged_work, list) {
+		if (now.tv_sec - work->tv_staged.tv_sec < opt_scantime)
+			break;
+		if (now.tv_sec - work->tv_staged.tv_sec < work_expiry(work))
+			continue;
+		unstage_work(work);
+		discard_work(work);
+		stale++;
+	}
 	mutex_unlock(stgd_lock);
 
 	if (opt_debug)
@@ -2591,95 +3388,170 @@ static int discard_stale(void)
 
 static bool queue_request(struct thr_info *thr, bool needed);
 
-static void restart_threads(void)
+/* Only threads mining on the chain that moved on need to drop their work */
+static void restart_threads(struct chain *chain)
 {
 	int i, stale;
 
 	/* Discard staged work that is now stale */
-	stale = discard_stale();
+	stale = discard_stale(chain);
 
 	for (i = 0; i < stale; i++)
 		queue_request(NULL, true);
 
-	for (i = 0; i < mining_threads; i++)
-		work_restart[i].restart = 1;
+	for (i = 0; i < mining_threads; i++) {
+		if (work_restart[i].chains & (1UL << (chain - chains)))
+			work_restart[i].restart = 1;
+	}
 }
 
-static void set_curblock(char *hexstr, unsigned char *hash)
+static void set_curblock(struct chain *chain, unsigned char *hash)
 {
 	unsigned char hash_swap[32];
 	char *old_hash = NULL;
 	struct timeval tv_now;
 
-	/* Don't free current_hash directly to avoid dereferencing it when
+	/* Don't free chain->hash directly to avoid dereferencing it when
 	 * we might be accessing its data elsewhere */
-	if (current_hash)
-		old_hash = current_hash;
-	strcpy(current_block, hexstr);
+	if (chain->hash)
+		old_hash = chain->hash;
 	gettimeofday(&tv_now, NULL);
-	get_timestamp(blocktime, &tv_now);
+	get_timestamp(chain->blocktime, &tv_now);
 	swap256(hash_swap, hash);
-	current_hash = bin2hex(hash_swap, 16);
-	if (unlikely(!current_hash))
+	chain->hash = bin2hex(hash_swap, 16);
+	if (unlikely(!chain->hash))
 		quit (1, "set_curblock OOM");
 	if (old_hash)
 		free(old_hash);
 }
 
-static void test_work_current(struct work *work)
+/* Must be called with blk_lock held */
+static struct block *find_block(struct chain *chain, const unsigned char *hash)
 {
-	struct block *s;
-	char *hexstr;
+	struct block *block;
 
-	hexstr = bin2hex(work->data, 18);
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "stage_thread OOM");
-		return;
+	list_for_each_entry(block, &chain->blocks, list) {
+		if (!memcmp(block->hash, hash, sizeof(block->hash)))
+			return block;
 	}
+	return NULL;
+}
+
+/* Forget blocks beyond BLOCK_HISTORY along with anything staged under them */
+static void prune_blocks(struct chain *chain)
+{
+	struct work *work, *tmp;
+	struct block *block;
+	int i, stale = 0;
+
+	mutex_lock(stgd_lock);
+	wr_lock(&blk_lock);
+	while (chain->nr_blocks > BLOCK_HISTORY) {
+		block = list_entry(chain->blocks.prev, struct block, list);
+		list_for_each_entry_safe(work, tmp, &block->staged, block_list) {
+			unstage_work(work);
+			discard_work(work);
+			stale++;
+		}
+		list_del(&block->list);
+		chain->nr_blocks--;
+		free(block);
+	}
+	wr_unlock(&blk_lock);
+	mutex_unlock(stgd_lock);
+
+	for (i = 0; i < stale; i++)
+		dec_queued();
+}
+
+static void test_work_current(struct work *work)
+{
+	struct chain *chain = work_chain(work);
+	unsigned char *prevhash = work->data + 4;
+	struct block *s;
 
 	/* Search to see if this block exists yet and if not, consider it a
-	 * new block and set the current block details to this one */
+	 * new block on its chain and set the current block details to it */
 	rd_lock(&blk_lock);
-	HASH_FIND_STR(blocks, hexstr, s);
+	s = find_block(chain, prevhash);
 	rd_unlock(&blk_lock);
 	if (!s) {
+		struct block *found;
+
 		s = calloc(sizeof(struct block), 1);
 		if (unlikely(!s))
 			quit (1, "test_work_current OOM");
-		strcpy(s->hash, hexstr);
+		memcpy(s->hash, prevhash, sizeof(s->hash));
+		INIT_LIST_HEAD(&s->staged);
+
+		/* Another thread may have added it since we looked */
 		wr_lock(&blk_lock);
-		HASH_ADD_STR(blocks, hash, s);
+		found = find_block(chain, prevhash);
+		if (!found) {
+			s->epoch = ++chain->epoch;
+			list_add(&s->list, &chain->blocks);
+			chain->nr_blocks++;
+			chain->current = s;
+		}
 		wr_unlock(&blk_lock);
-		set_curblock(hexstr, work->data);
+		if (found) {
+			free(s);
+			work->block = found;
+			work->epoch = found->epoch;
+			return;
+		}
+		work->block = s;
+		work->epoch = s->epoch;
+		set_curblock(chain, work->data);
 
 		new_blocks++;
-		if (block_changed != BLOCK_LP && block_changed != BLOCK_FIRST) {
-			block_changed = BLOCK_DETECT;
+		if (chain->changed != BLOCK_LP && chain->changed != BLOCK_FIRST) {
+			chain->changed = BLOCK_DETECT;
 			if (have_longpoll)
 				applog(LOG_WARNING, "New block detected on network before longpoll, waiting on fresh work");
 			else
 				applog(LOG_WARNING, "New block detected on network, waiting on fresh work");
 		} else
-			block_changed = BLOCK_NONE;
-		restart_threads();
+			chain->changed = BLOCK_NONE;
+		restart_threads(chain);
+		prune_blocks(chain);
+	} else {
+		work->block = s;
+		work->epoch = s->epoch;
 	}
-
-	free(hexstr);
-}
-
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
 }
 
+/*
+ * Keep staged_work ordered by tv_staged.  Fresh work is the newest and goes
+ * straight on the tail; divided work coming back is older and is placed
+ * ahead of anything staged after it.
+ */
 static bool hash_push(struct work *work)
 {
+	struct list_head *pos = &staged_work;
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
+	if (unlikely(work_chain(work)->epoch - work->epoch >= BLOCK_HISTORY)) {
+		/* its block has been pruned from under it */
+		mutex_unlock(stgd_lock);
+		discard_work(work);
+		dec_queued();
+		return true;
+	}
 	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+		if (!list_empty(&staged_work) &&
+		    list_entry(staged_work.prev, struct work, list)->tv_staged.tv_sec >
+		    work->tv_staged.tv_sec) {
+			list_for_each(pos, &staged_work) {
+				if (list_entry(pos, struct work, list)->tv_staged.tv_sec >
+				    work->tv_staged.tv_sec)
+					break;
+			}
+		}
+		list_add_tail(&work->list, pos);
+		list_add_tail(&work->block_list, &work->block->staged);
+		staged_count++;
 		if (work->clone)
 			++staged_clones;
 	} else
@@ -2689,6 +3561,157 @@ static bool hash_push(struct work *work)
 	return rc;
 }
 
+static inline bool can_roll(struct work *work)
+{
+	return (work->pool && !stale_work(work) &&
+		work->rolls < work->rolltime && !work->clone);
+}
+
+/* Nonce ranges are handed out in multiples of NONCE_CHUNK; the last one ends
+ * at NONCE_END, short of 2^32 so the scanhash kernels can't wrap */
+#define NONCE_CHUNK	(1U << 20)
+#define NONCE_END	0xfffffffaU
+
+static void roll_work(struct work *work)
+{
+	uint32_t *work_ntime;
+	uint32_t ntime;
+
+	work_ntime = (uint32_t *)(work->data + 68);
+	ntime = be32toh(*work_ntime);
+	ntime++;
+	*work_ntime = htobe32(ntime);
+	local_work++;
+	work->rolls++;
+	work->blk.nonce = 0;
+	work->nonce_end = NONCE_END;
+	if (opt_debug)
+		applog(LOG_DEBUG, "Successfully rolled work");
+}
+
+/*
+ * Ntime rolling work generator.  The newest rollable getwork from each pool
+ * is kept as that pool's roll source, and every roll_stage() cuts one more
+ * variant from it with ntime a second further on, for as many seconds as the
+ * pool's X-Roll-Ntime expiry allows.  Variants are staged on demand in place
+ * of a getwork, so they are counted as queued work like one.
+ */
+static void roll_source(struct work *work)
+{
+	struct pool *pool = work->pool;
+	struct work *src, *old;
+
+	if (!pool || !work->rolltime || work->rolls || work->clone)
+		return;
+
+	src = make_work();
+	memcpy(src, work, sizeof(*src));
+	mutex_lock(&pool->pool_lock);
+	old = pool->roll_src;
+	pool->roll_src = src;
+	mutex_unlock(&pool->pool_lock);
+	if (old)
+		free_work(old);
+}
+
+static bool roll_stage(struct pool *pool)
+{
+	struct work *work = NULL, *old = NULL;
+
+	mutex_lock(&pool->pool_lock);
+	if (pool->roll_src) {
+		if (can_roll(pool->roll_src)) {
+			roll_work(pool->roll_src);
+			work = make_work();
+			memcpy(work, pool->roll_src, sizeof(*work));
+		} else {
+			old = pool->roll_src;
+			pool->roll_src = NULL;
+		}
+	}
+	mutex_unlock(&pool->pool_lock);
+	if (old)
+		free_work(old);
+	if (!work)
+		return false;
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Staging ntime roll %d of pool %d work",
+		       work->rolls, pool->pool_no);
+	inc_queued();
+	if (unlikely(!hash_push(work))) {
+		dec_queued();
+		free_work(work);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Build another work item from the pool's newest block template, for as
+ * long as it is younger than the scan time.  After that a fresh template is
+ * fetched to pick up new transactions.  A stratum pool's newest job is good
+ * until it sends the next.
+ */
+static bool gbt_stage(struct pool *pool)
+{
+	struct gbt_tmpl *tmpl;
+	struct timeval now;
+	struct work *work;
+	unsigned int aux_id;
+
+	if (!opt_gbt && !pool->has_stratum)
+		return false;
+
+	mutex_lock(&aux_pool.pool_lock);
+	aux_id = aux_block.id;
+	mutex_unlock(&aux_pool.pool_lock);
+
+	/* A template committing to an old aux block only serves the parent,
+	 * so fetch another */
+	work = make_work();
+	gettimeofday(&now, NULL);
+	mutex_lock(&pool->pool_lock);
+	tmpl = pool->tmpl[pool->tmpl_id % GBT_KEEP];
+	if (tmpl && (pool->has_stratum ||
+		     (now.tv_sec - tmpl->tv_fetched.tv_sec < opt_scantime &&
+		      tmpl->aux.id == aux_id)))
+		gbt_work(tmpl, work);
+	else
+		tmpl = NULL;
+	mutex_unlock(&pool->pool_lock);
+	if (!tmpl) {
+		free_work(work);
+		return false;
+	}
+
+	work->pool = pool;
+	local_work++;
+	test_work_current(work);
+	if (stale_work(work)) {
+		/* a newer block has turned up since the template */
+		free_work(work);
+		return false;
+	}
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Staging extranonce %llu of pool %d template %u",
+		       (unsigned long long)work->extranonce, pool->pool_no, work->tmpl_id);
+	inc_queued();
+	if (unlikely(!hash_push(work))) {
+		dec_queued();
+		free_work(work);
+		return false;
+	}
+	return true;
+}
+
+/* Stage work made locally from what pool has already sent, if it can be */
+static inline bool local_stage(struct pool *pool)
+{
+	return roll_stage(pool) || gbt_stage(pool);
+}
+
 static void *stage_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
@@ -2710,6 +3733,7 @@ static void *stage_thread(void *userdata)
 		}
 
 		test_work_current(work);
+		roll_source(work);
 
 		if (opt_debug)
 			applog(LOG_DEBUG, "Pushing work to getwork queue");
@@ -3267,36 +4291,66 @@ static void *input_thread(void *userdata)
 static void *workio_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
-	bool ok = true;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	/* only while waiting on our queue, not while holding pool locks */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-	while (ok) {
+	while (42) {
+		struct timespec abstime, *wait = NULL;
+		struct timeval now, next;
 		struct workio_cmd *wc;
 
+		io_reap();
+		gettimeofday(&now, NULL);
+		while ((wc = io_next(&now, &next))) {
+			list_del(&wc->list);
+			io_start(wc);
+		}
+		if (timerisset(&next)) {
+			abstime.tv_sec = next.tv_sec;
+			abstime.tv_nsec = next.tv_usec * 1000;
+			wait = &abstime;
+		}
+
 		if (opt_debug)
 			applog(LOG_DEBUG, "Popping work to work thread");
 
 		/* wait for workio_cmd sent to us, on our queue */
-		wc = tq_pop(mythr->q, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		wc = tq_pop(mythr->q, wait);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (unlikely(!wc)) {
+			if (wait)
+				continue;
 			applog(LOG_ERR, "Failed to tq_pop in workio_thread");
-			ok = false;
 			break;
 		}
 
-		/* process workio_cmd */
+		if (wc == (void *)&io_wake)
+			continue;
+
 		switch (wc->cmd) {
 		case WC_GET_WORK:
-			ok = workio_get_work(wc);
+			wc->pool = select_pool(wc->lagging);
 			break;
 		case WC_SUBMIT_WORK:
-			ok = workio_submit_work(wc);
+			wc->pool = wc->u.work->pool;
+			if (wc->pool->io_submits >= POOL_MAX_SUBMITS) {
+				applog(LOG_WARNING, "Pool %d has %d shares waiting, discarding share",
+				       wc->pool->pool_no, wc->pool->io_submits);
+				workio_cmd_free(wc);
+				continue;
+			}
+			wc->pool->io_submits++;
 			break;
 		default:
-			ok = false;
-			break;
+			applog(LOG_ERR, "Unknown workio_cmd %d", wc->cmd);
+			workio_cmd_free(wc);
+			continue;
 		}
+		gettimeofday(&wc->due, NULL);
+		io_queue(wc);
 	}
 
 	tq_freeze(mythr->q);
@@ -3423,12 +4477,205 @@ out_unlock:
 	}
 }
 
+static void pool_died(struct pool *pool);
+
+/* Fail the shares still waiting on pool's lost connection, to be resent */
+static void stratum_fail_shares(struct pool *pool)
+{
+	struct stratum_share *sshare, *tmp;
+	LIST_HEAD(failed);
+
+	mutex_lock(&pool->pool_lock);
+	list_splice_init(&pool->stratum_shares, &failed);
+	mutex_unlock(&pool->pool_lock);
+
+	list_for_each_entry_safe(sshare, tmp, &failed, list) {
+		json_rpc_deliver(NULL, submit_work_done, sshare->wc);
+		free(sshare);
+	}
+}
+
+/* Jobs, and the extranonce1 in them, only hold on the connection they came
+ * on, so shares from them become stale rather than being resent */
+static void stratum_drop_jobs(struct pool *pool)
+{
+	int i;
+
+	mutex_lock(&pool->pool_lock);
+	for (i = 0; i < GBT_KEEP; i++) {
+		gbt_free(pool->tmpl[i]);
+		pool->tmpl[i] = NULL;
+	}
+	mutex_unlock(&pool->pool_lock);
+}
+
+/* A job sent with clean_jobs set ends all of pool's older ones, even on the
+ * same block, so drop them and the work staged from them */
+static int stratum_clean_jobs(struct pool *pool, unsigned int tmpl_id)
+{
+	struct gbt_tmpl *old[GBT_KEEP];
+	struct work *work, *tmp;
+	int i, stale = 0;
+
+	mutex_lock(&pool->pool_lock);
+	for (i = 0; i < GBT_KEEP; i++) {
+		old[i] = NULL;
+		if (pool->tmpl[i] && pool->tmpl[i]->id != tmpl_id) {
+			old[i] = pool->tmpl[i];
+			pool->tmpl[i] = NULL;
+		}
+	}
+	mutex_unlock(&pool->pool_lock);
+	for (i = 0; i < GBT_KEEP; i++)
+		gbt_free(old[i]);
+
+	mutex_lock(stgd_lock);
+	list_for_each_entry_safe(work, tmp, &staged_work, list) {
+		if (work->pool != pool || work->tmpl_id == tmpl_id)
+			continue;
+		unstage_work(work);
+		discard_work(work);
+		stale++;
+	}
+	mutex_unlock(stgd_lock);
+
+	for (i = 0; i < stale; i++)
+		dec_queued();
+	return stale;
+}
+
+/*
+ * Keep a new job as pool's newest template.  Work from it goes to the
+ * stage thread only if pool is the one being mined, where a job on a new
+ * block restarts the miners as soon as it arrives.  So does one that
+ * cleans out the jobs before it.
+ */
+static void stratum_notify(struct pool *pool, const json_t *params)
+{
+	struct gbt_tmpl *tmpl;
+	struct work *work;
+	bool clean;
+	int i, stale;
+
+	clean = json_is_true(json_array_get(params, 8));
+	tmpl = stratum_decode(pool, params);
+	if (unlikely(!tmpl))
+		return;
+	if (opt_debug)
+		applog(LOG_DEBUG, "Pool %d stratum job %s", pool->pool_no, tmpl->job_id);
+
+	work = make_work();
+	pool_add_tmpl(pool, tmpl, work);
+	work->pool = pool;
+	total_getworks++;
+	pool->getwork_requested++;
+	pool->stratum_ready = true;
+	stale = clean ? stratum_clean_jobs(pool, work->tmpl_id) : 0;
+	if (pool != current_pool()) {
+		free_work(work);
+		return;
+	}
+
+	inc_queued();
+	if (unlikely(!tq_push(thr_info[stage_thr_id].q, work))) {
+		applog(LOG_ERR, "Failed to tq_push in stratum_notify");
+		dec_queued();
+		free_work(work);
+		return;
+	}
+	if (clean) {
+		for (i = 0; i < stale; i++)
+			queue_request(NULL, true);
+		restart_threads(pool->chain);
+	}
+}
+
+/* Read everything pool's stratum connection sends, reconnecting as needed */
+static void *stratum_thread(void *userdata)
+{
+	struct pool *pool = userdata;
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		struct stratum_share *sshare;
+		const char *method;
+		json_t *val;
+
+		if (!pool->stratum_up && !stratum_connect(pool)) {
+			sleep(opt_fail_pause);
+			continue;
+		}
+
+		val = stratum_recv(pool);
+		if (!val) {
+			applog(LOG_WARNING, "Pool %d stratum connection lost", pool->pool_no);
+			stratum_disconnect(pool);
+			pool->stratum_ready = false;
+			stratum_drop_jobs(pool);
+			stratum_fail_shares(pool);
+			pool_died(pool);
+			continue;
+		}
+
+		method = json_string_value(json_object_get(val, "method"));
+		if (method) {
+			json_t *params = json_object_get(val, "params");
+
+			if (!strcmp(method, "mining.notify"))
+				stratum_notify(pool, params);
+			else if (!strcmp(method, "mining.set_difficulty"))
+				pool->sdiff = json_number_value(json_array_get(params, 0));
+			else if (opt_debug)
+				applog(LOG_DEBUG, "Pool %d stratum method %s ignored", pool->pool_no, method);
+		} else if (json_integer_value(json_object_get(val, "id")) == pool->stratum_auth_id) {
+			if (!json_is_true(json_object_get(val, "result")))
+				applog(LOG_WARNING, "Pool %d stratum authorisation failed", pool->pool_no);
+		} else {
+			sshare = stratum_take_share(pool, json_integer_value(json_object_get(val, "id")));
+			if (sshare) {
+				/* submit_work_done has val now */
+				json_rpc_deliver(val, submit_work_done, sshare->wc);
+				free(sshare);
+				continue;
+			}
+		}
+		json_decref(val);
+	}
+
+	return NULL;
+}
+
+/* Start pool's stratum connection if it isn't yet, and give it as long as
+ * a getwork probe to come up with a job */
+static bool stratum_active(struct pool *pool)
+{
+	pthread_t pth;
+	int i;
+
+	if (!pool->stratum_started) {
+		INIT_LIST_HEAD(&pool->stratum_shares);
+		if (unlikely(pthread_mutex_init(&pool->stratum_lock, NULL)))
+			quit(1, "Failed to pthread_mutex_init in stratum_active");
+		if (unlikely(pthread_create(&pth, NULL, stratum_thread, pool)))
+			quit(1, "stratum thread create failed");
+		pool->stratum_started = true;
+	}
+
+	for (i = 0; i < 15 && !pool->stratum_ready; i++)
+		sleep(1);
+	return pool->stratum_ready;
+}
+
 static bool pool_active(struct pool *pool, bool pinging)
 {
 	bool ret = false;
 	json_t *val;
 	CURL *curl;
-	bool rolltime;
+	int rolltime;
+
+	if (pool->has_stratum)
+		return stratum_active(pool);
 
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
@@ -3437,19 +4684,19 @@ static bool pool_active(struct pool *pool, bool pinging)
 	}
 
 	applog(LOG_INFO, "Testing pool %s", pool->rpc_url);
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, rpc_req,
+	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, work_req(),
 			true, false, &rolltime, pool);
 
 	if (val) {
 		struct work *work = make_work();
 		bool rc;
 
-		rc = work_decode(json_object_get(val, "result"), work);
+		rc = pool_decode(pool, json_object_get(val, "result"), work);
 		if (rc) {
 			applog(LOG_DEBUG, "Successfully retrieved and deciphered work from pool %u %s",
 			       pool->pool_no, pool->rpc_url);
 			work->pool = pool;
-			work->rolltime = rolltime;
+			work->rolltime = roll_time(rolltime);
 			if (opt_debug)
 				applog(LOG_DEBUG, "Pushing pooltest work to base pool");
 
@@ -3507,15 +4754,15 @@ static bool queue_request(struct thr_info *thr, bool needed)
 	struct workio_cmd *wc;
 	int rq = requests_queued();
 
-	if (rq >= mining_threads + staged_clones)
+	if (rq >= queue_depth + staged_clones)
+		return true;
+
+	/* Make work from what we already have before asking the pool */
+	if (local_stage(current_pool()))
 		return true;
 
 	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	if (unlikely(!wc)) {
-		applog(LOG_ERR, "Failed to calloc wc in queue_request");
-		return false;
-	}
+	wc = obj_alloc(&workio_cmd_pool);
 
 	wc->cmd = WC_GET_WORK;
 	if (thr)
@@ -3549,7 +4796,7 @@ struct work *hash_pop(const struct timespec *abstime)
 	int rc;
 
 	mutex_lock(stgd_lock);
-	if (HASH_COUNT(staged_work))
+	if (staged_count)
 		goto pop;
 
 	if (abstime)
@@ -3558,81 +4805,63 @@ struct work *hash_pop(const struct timespec *abstime)
 		rc = pthread_cond_wait(&getq->cond, stgd_lock);
 	if (rc)
 		goto out;
-	if (!HASH_COUNT(staged_work))
+	if (!staged_count)
 		goto out;
 
 pop:
-	work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work->clone)
-		--staged_clones;
+	work = list_entry(staged_work.next, struct work, list);
+	unstage_work(work);
 out:
 	mutex_unlock(stgd_lock);
 	return work;
 }
 
-static inline bool should_roll(struct work *work)
+/*
+ * Give work the next nonce range of the staged master, sized so a thread
+ * hashing at mhs MH/s gets through it about when the master expires and
+ * fresh work is due.  Threads with no measured rate yet, or a range that
+ * would leave less than a chunk behind, take the whole remainder.  Returns
+ * true if the master has nonces left and should be restaged.
+ */
+static bool divide_work(struct timeval *now, struct work *master,
+			struct work *work, double mhs)
 {
-	int rs;
+	work->nonce_end = NONCE_END;
 
-	rs = requests_staged();
-	if (rs >= mining_threads)
-		return false;
-	if (work->pool == current_pool() || pool_strategy == POOL_LOADBALANCE || !rs)
-		return true;
-	return false;
-}
+	if (!master->clone && mhs > 0) {
+		uint32_t left = NONCE_END - master->blk.nonce;
+		int secs = work_expiry(master) - (now->tv_sec - master->tv_staged.tv_sec);
+		double want = mhs * 1000000 * (secs > 0 ? secs : 1);
 
-static inline bool can_roll(struct work *work)
-{
-	return (work->pool && !stale_work(work) && work->rolltime &&
-		work->rolls < 11 && !work->clone);
-}
+		if (want + NONCE_CHUNK < left) {
+			uint32_t range = ((uint32_t)want + NONCE_CHUNK - 1) & ~(NONCE_CHUNK - 1);
 
-static void roll_work(struct work *work)
-{
-	uint32_t *work_ntime;
-	uint32_t ntime;
-
-	work_ntime = (uint32_t *)(work->data + 68);
-	ntime = be32toh(*work_ntime);
-	ntime++;
-	*work_ntime = htobe32(ntime);
-	local_work++;
-	work->rolls++;
-	work->blk.nonce = 0;
-	if (opt_debug)
-		applog(LOG_DEBUG, "Successfully rolled work");
+			work->nonce_end = master->blk.nonce + range;
+			master->blk.nonce = work->nonce_end;
+			master->cloned = true;
+			local_work++;
+			if (opt_debug)
+				applog(LOG_DEBUG, "Divided off nonces %08x-%08x",
+				       work->blk.nonce, work->nonce_end);
+			return true;
+		}
+	}
+	return false;
 }
 
-/* Recycle the work at a higher starting res_nonce if we know the thread we're
- * giving it to will not finish scanning it. We keep the master copy to be
- * recycled more rapidly and discard the clone to avoid repeating work */
-static bool divide_work(struct timeval *now, struct work *work, uint32_t hash_div)
+/* Record the chains of all the work thr_id now holds, for restart_threads */
+static void set_thread_chains(int thr_id, struct work **works, int n)
 {
-	uint64_t hash_inc;
-
-	if (work->clone)
-		return false;
+	unsigned long mask = 0;
+	int i;
 
-	hash_inc = MAXTHREADS / hash_div * 2;
-	if ((uint64_t)work->blk.nonce + hash_inc < MAXTHREADS) {
-		/* Okay we can divide it up */
-		work->blk.nonce += hash_inc;
-		work->cloned = true;
-		local_work++;
-		if (opt_debug)
-			applog(LOG_DEBUG, "Successfully divided work");
-		return true;
-	} else if (can_roll(work) && should_roll(work)) {
-		roll_work(work);
-		return true;
-	}
-	return false;
+	for (i = 0; i < n; i++)
+		mask |= chain_bit(works[i]);
+	work_restart[thr_id].chains = mask;
 }
 
 static bool get_work(struct work *work, bool requested, struct thr_info *thr,
-		     const int thr_id, uint32_t hash_div)
+		     const int thr_id, double mhs)
 {
 	struct timespec abstime = {};
 	struct timeval now;
@@ -3646,17 +4875,12 @@ static bool get_work(struct work *work, bool requested, struct thr_info *thr,
 	thread_reportout(thr);
 retry:
 	pool = current_pool();
-	if (unlikely((!requested || requests_queued() < opt_queue) && !queue_request(thr, true))) {
+	if (unlikely((!requested || requests_queued() < queue_depth) && !queue_request(thr, true))) {
 		applog(LOG_WARNING, "Failed to queue_request in get_work");
 		goto out;
 	}
 
-	if (!requests_staged()) {
-		if (can_roll(work)) {
-			roll_work(work);
-			ret = true;
-			goto out;
-		}
+	if (!requests_staged() && !local_stage(pool)) {
 		if (requested && requests_queued() >= mining_threads &&
 		    !pool_tset(pool, &pool->lagging)) {
 			applog(LOG_WARNING, "Pool %d not providing work fast enough",
@@ -3681,114 +4905,473 @@ retry:
 		goto retry;
 	}
 
-	if (stale_work(work_heap)) {
-		dec_queued();
-		discard_work(work_heap);
-		goto retry;
+	if (stale_work(work_heap)) {
+		dec_queued();
+		discard_work(work_heap);
+		goto retry;
+	}
+
+	pool = work_heap->pool;
+	/* If we make it here we have succeeded in getting fresh work */
+	if (!work_heap->mined) {
+		pool_tclear(pool, &pool->lagging);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+	}
+
+	memcpy(work, work_heap, sizeof(*work));
+	/* A thread mining lanes holds work from several get_work calls, so
+	 * add to its chains; set_thread_chains drops the ones it has left */
+	work_restart[thr_id].chains |= chain_bit(work);
+
+	/* Restage whatever is left of the master and make the work we're
+	 * handing out be clone */
+	if (divide_work(&now, work_heap, work, mhs)) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "Pushing divided work to get queue head");
+
+		hash_push(work_heap);
+		work->clone = true;
+	} else {
+		dec_queued();
+		free_work(work_heap);
+	}
+
+	ret = true;
+out:
+	if (unlikely(ret == false)) {
+		if ((opt_retries >= 0) && (++failures > opt_retries)) {
+			applog(LOG_ERR, "Failed %d times to get_work", failures);
+			return ret;
+		}
+		applog(LOG_DEBUG, "Retrying after %d seconds", opt_fail_pause);
+		sleep(opt_fail_pause);
+		goto retry;
+	}
+
+	work->thr_id = thr_id;
+	thread_reportin(thr);
+	if (ret)
+		work->mined = true;
+	return ret;
+}
+
+static bool submit_work_sync(struct thr_info *thr, const struct work *work_in)
+{
+	struct workio_cmd *wc;
+
+	/* fill out work request message */
+	wc = obj_alloc(&workio_cmd_pool);
+
+	wc->u.work = make_work();
+	wc->cmd = WC_SUBMIT_WORK;
+	wc->thr = thr;
+	memcpy(wc->u.work, work_in, sizeof(*work_in));
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Pushing submit work to work thread");
+
+	/* send solution to workio thread */
+	if (unlikely(!tq_push(thr_info[work_thr_id].q, wc))) {
+		/* workio_thread moves everything on to io_pending as it
+		 * arrives, so a full queue means it is stuck; drop this share
+		 * rather than stall the mining thread */
+		if (!thr_info[work_thr_id].q->frozen) {
+			applog(LOG_WARNING, "Work thread queue full, discarding share");
+			workio_cmd_free(wc);
+			return true;
+		}
+		applog(LOG_ERR, "Failed to tq_push work in submit_work_sync");
+		goto err_out;
+	}
+
+	return true;
+err_out:
+	workio_cmd_free(wc);
+	return false;
+}
+
+bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+{
+	work->data[64+12+0] = (nonce>>0) & 0xff;
+	work->data[64+12+1] = (nonce>>8) & 0xff;
+	work->data[64+12+2] = (nonce>>16) & 0xff;
+	work->data[64+12+3] = (nonce>>24) & 0xff;
+	/* Do one last check before attempting to submit the work */
+	if (!fulltest(work->data + 64, work->target))
+		return true;
+	return submit_work_sync(thr, work);
+}
+
+/* Most shares a CPU thread collects in one scan before submitting them */
+#define CPU_MAX_FOUND 16
+
+/* Scan from nonce with the selected CPU kernel, stopping at the first share */
+static int cpu_scanhash(int thr_id, struct work *work, uint32_t max_nonce,
+			unsigned long *hashes_done, uint32_t nonce)
+{
+	bool rc;
+
+	switch (opt_algo) {
+	case ALGO_C:
+		rc = scanhash_c(thr_id, work->midstate, work->data + 64,
+			        work->hash1, work->hash, work->target,
+				max_nonce, hashes_done,
+				nonce);
+		break;
+
+#ifdef WANT_X8632_SSE2
+	case ALGO_SSE2_32: {
+		unsigned int rc5 =
+		        scanhash_sse2_32(thr_id, work->midstate, work->data + 64,
+					 work->hash1, work->hash,
+					 work->target,
+				         max_nonce, hashes_done,
+					 nonce);
+		rc = (rc5 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_X8664_SSE2
+	case ALGO_SSE2_64: {
+		unsigned int rc5 =
+		        scanhash_sse2_64(thr_id, work->midstate, work->data + 64,
+					 work->hash1, work->hash,
+					 work->target,
+				         max_nonce, hashes_done,
+					 nonce);
+		rc = (rc5 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_X8664_SSE4
+	case ALGO_SSE4_64: {
+		unsigned int rc5 =
+		        scanhash_sse4_64(thr_id, work->midstate, work->data + 64,
+					 work->hash1, work->hash,
+					 work->target,
+				         max_nonce, hashes_done,
+					 nonce);
+		rc = (rc5 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_SSE2_4WAY
+	case ALGO_4WAY: {
+		unsigned int rc4 =
+			ScanHash_4WaySSE2(thr_id, work->midstate, work->data + 64,
+					  work->hash1, work->hash,
+					  work->target,
+					  max_nonce, hashes_done,
+					  nonce);
+		rc = (rc4 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_AVX2_8WAY
+	case ALGO_AVX2_8WAY: {
+		unsigned int rc8 =
+			ScanHash_8WayAVX2(thr_id, work->midstate, work->data + 64,
+					  work->hash1, work->hash,
+					  work->target,
+					  max_nonce, hashes_done,
+					  nonce);
+		rc = (rc8 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_AVX512_16WAY
+	case ALGO_AVX512_16WAY: {
+		unsigned int rc16 =
+			ScanHash_16WayAVX512(thr_id, work->midstate, work->data + 64,
+					     work->hash1, work->hash,
+					     work->target,
+					     max_nonce, hashes_done,
+					     nonce);
+		rc = (rc16 == -1) ? false : true;
+		}
+		break;
+#endif
+
+	case ALGO_C_PRECALC:
+		rc = scanhash_c_precalc(thr_id, work->midstate, work->data + 64,
+			        work->hash1, work->hash, work->target,
+				max_nonce, hashes_done,
+				nonce);
+		break;
+
+#ifdef WANT_SHANI
+	case ALGO_SHANI:
+		rc = scanhash_shani(thr_id, work->midstate, work->data + 64,
+			        work->hash1, work->hash, work->target,
+				max_nonce, hashes_done,
+				nonce);
+		break;
+#endif
+
+#ifdef WANT_VIA_PADLOCK
+	case ALGO_VIA:
+		rc = scanhash_via(thr_id, work->data, work->target,
+				  max_nonce, hashes_done,
+				  nonce);
+		break;
+#endif
+	case ALGO_CRYPTOPP:
+		rc = scanhash_cryptopp(thr_id, work->midstate, work->data + 64,
+			        work->hash1, work->hash, work->target,
+				max_nonce, hashes_done,
+				nonce);
+		break;
+
+#ifdef WANT_CRYPTOPP_ASM32
+	case ALGO_CRYPTOPP_ASM32:
+		rc = scanhash_asm32(thr_id, work->midstate, work->data + 64,
+			        work->hash1, work->hash, work->target,
+				max_nonce, hashes_done,
+				nonce);
+		break;
+#endif
+
+	default:
+		/* should never happen */
+		return -1;
+	}
+
+	return rc;
+}
+
+/* The yasm kernels hash the nonce they are passed; the others start one on */
+static inline bool scans_from_nonce(enum sha256_algos algo)
+{
+	return algo == ALGO_SSE2_32 || algo == ALGO_SSE2_64 || algo == ALGO_SSE4_64;
+}
+
+/*
+ * Scan the whole range from work->blk.nonce to max_nonce and collect every
+ * share in nonces[].  Kernels with a _bulk entry point do this in one pass;
+ * the rest are restarted just past each share they stop at.
+ */
+static int cpu_scanhash_bulk(int thr_id, struct work *work, uint32_t max_nonce,
+			     unsigned long *hashes_done, uint32_t *nonces, int max_found)
+{
+	uint32_t nonce = work->blk.nonce;
+	int found = 0, rc;
+
+	switch (opt_algo) {
+#ifdef WANT_SSE2_4WAY
+	case ALGO_4WAY:
+		return ScanHash_4WaySSE2_bulk(thr_id, work->midstate, work->data + 64,
+					      work->hash1, work->hash, work->target,
+					      max_nonce, hashes_done, nonce,
+					      nonces, max_found);
+#endif
+#ifdef WANT_AVX2_8WAY
+	case ALGO_AVX2_8WAY:
+		return ScanHash_8WayAVX2_bulk(thr_id, work->midstate, work->data + 64,
+					      work->hash1, work->hash, work->target,
+					      max_nonce, hashes_done, nonce,
+					      nonces, max_found);
+#endif
+#ifdef WANT_AVX512_16WAY
+	case ALGO_AVX512_16WAY:
+		return ScanHash_16WayAVX512_bulk(thr_id, work->midstate, work->data + 64,
+						 work->hash1, work->hash, work->target,
+						 max_nonce, hashes_done, nonce,
+						 nonces, max_found);
+#endif
+	default:
+		break;
+	}
+
+	while (found < max_found) {
+		rc = cpu_scanhash(thr_id, work, max_nonce, hashes_done, nonce);
+		if (unlikely(rc < 0))
+			return rc;
+		if (!rc)
+			break;
+		nonces[found++] = *(uint32_t *)(work->data + 64 + 12);
+
+		/* After a hit the yasm kernels leave *hashes_done on the base of
+		 * the winner's lane group and hash from the nonce they are given,
+		 * while the rest stop on the winner and step past it first, so
+		 * work out where to carry on from rather than trusting it */
+		nonce = nonces[found - 1];
+		if (scans_from_nonce(opt_algo))
+			nonce++;
+		*hashes_done = nonce;
+
+		/* the kernels clear the restart flag on entry, so check it here */
+		if (nonce < nonces[found - 1] || nonce >= max_nonce ||
+		    work_restart[thr_id].restart)
+			break;
 	}
+	return found;
+}
 
-	pool = work_heap->pool;
-	/* If we make it here we have succeeded in getting fresh work */
-	if (!work_heap->mined) {
-		pool_tclear(pool, &pool->lagging);
-		if (pool_tclear(pool, &pool->idle))
-			pool_resus(pool);
+#ifdef WANT_SSE2_4WAY
+/*
+ * --lane-pack: each of the 4way kernel's SIMD lanes scans its own work item.
+ * Lanes whose work runs out, goes stale or exceeds the scan time are refilled
+ * on their own while the rest carry on, so the lanes stay full across work
+ * and nonce range boundaries.
+ */
+static void *miner_thread_lanes(struct thr_info *mythr)
+{
+	const int thr_id = mythr->id;
+	struct work *works[SCAN_LANES];
+	struct scan_lane lanes[SCAN_LANES];
+	struct timeval tv_workstart[SCAN_LANES];
+	bool needs_work[SCAN_LANES];
+	uint32_t count = 0xffffff / SCAN_LANES;
+	/* Try to cycle approximately 5 times before each log update */
+	const unsigned long cycle = opt_log_interval / 5 ? : 1;
+	unsigned const int request_interval = opt_scantime * 2 / 3 ? : 1;
+	bool requested = false;
+	int l;
+
+	for (l = 0; l < SCAN_LANES; l++) {
+		works[l] = make_work();
+		/* Invalidate pool so it fails can_roll() test */
+		works[l]->pool = NULL;
+		needs_work[l] = true;
 	}
 
-	memcpy(work, work_heap, sizeof(*work));
+	while (1) {
+		struct timeval tv_start, tv_end, diff;
+		uint32_t nonces[CPU_MAX_FOUND];
+		int nonce_lanes[CPU_MAX_FOUND];
+		unsigned long hashes_done;
+		uint64_t next_count;
+		int found, i;
 
-	/* Copy the res nonce back so we know to start at a higher baseline
-	 * should we divide the same work up again. Make the work we're
-	 * handing out be clone */
-	if (divide_work(&now, work_heap, hash_div)) {
-		if (opt_debug)
-			applog(LOG_DEBUG, "Pushing divided work to get queue head");
+		for (l = 0; l < SCAN_LANES; l++) {
+			struct work *work = works[l];
 
-		hash_push(work_heap);
-		work->clone = true;
-	} else {
-		dec_queued();
-		free_work(work_heap);
-	}
+			if (!needs_work[l])
+				continue;
+			gettimeofday(&tv_workstart[l], NULL);
+			/* each lane hashes at a quarter of the thread's rate */
+			if (unlikely(!get_work(work, requested, mythr, thr_id,
+					       mythr->rolling / SCAN_LANES))) {
+				applog(LOG_ERR, "work retrieval failed, exiting "
+					"mining thread %d", thr_id);
+				goto out;
+			}
+			needs_work[l] = requested = false;
 
-	ret = true;
-out:
-	if (unlikely(ret == false)) {
-		if ((opt_retries >= 0) && (++failures > opt_retries)) {
-			applog(LOG_ERR, "Failed %d times to get_work");
-			return ret;
+			lanes[l].midstate = work->midstate;
+			lanes[l].data = work->data + 64;
+			lanes[l].hash1 = work->hash1;
+			lanes[l].target = work->target;
 		}
-		applog(LOG_DEBUG, "Retrying after %d seconds", fail_pause);
-		sleep(fail_pause);
-		fail_pause += opt_fail_pause;
-		goto retry;
-	}
-	fail_pause = opt_fail_pause;
+		set_thread_chains(thr_id, works, SCAN_LANES);
 
-	work->thr_id = thr_id;
-	thread_reportin(thr);
-	if (ret)
-		work->mined = true;
-	return ret;
-}
+		/* No lane may run past the end of its nonce range */
+		for (l = 0; l < SCAN_LANES; l++) {
+			lanes[l].nonce = works[l]->blk.nonce;
+			if (count > works[l]->nonce_end - lanes[l].nonce)
+				count = works[l]->nonce_end - lanes[l].nonce;
+		}
 
-static bool submit_work_sync(struct thr_info *thr, const struct work *work_in)
-{
-	struct workio_cmd *wc;
+		gettimeofday(&tv_start, NULL);
+		found = ScanHash_4WaySSE2_lanes(thr_id, lanes, count, &hashes_done,
+						nonces, nonce_lanes, CPU_MAX_FOUND);
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
 
-	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	if (unlikely(!wc)) {
-		applog(LOG_ERR, "Failed to calloc wc in submit_work_sync");
-		return false;
-	}
+		hashmeter(thr_id, &diff, hashes_done * SCAN_LANES);
+		for (l = 0; l < SCAN_LANES; l++)
+			works[l]->blk.nonce = lanes[l].nonce;
 
-	wc->u.work = make_work();
-	wc->cmd = WC_SUBMIT_WORK;
-	wc->thr = thr;
-	memcpy(wc->u.work, work_in, sizeof(*work_in));
+		/* adjust the per-lane count to meet target cycle time */
+		if (diff.tv_usec > 500000)
+			diff.tv_sec++;
+		if (diff.tv_sec && diff.tv_sec != cycle) {
+			next_count = ((uint64_t)hashes_done * (uint64_t)cycle) / (uint64_t)diff.tv_sec;
+			if (next_count > (uint64_t)count / 2 * 3)
+				next_count = count / 2 * 3;
+		} else if (!diff.tv_sec)
+			next_count = (uint64_t)hashes_done * 2;
+		else
+			next_count = count;
+		if (next_count < 1)
+			next_count = 0xffffff / SCAN_LANES;
+		if (next_count > NONCE_END)
+			next_count = NONCE_END;
+		count = next_count;
 
-	if (opt_debug)
-		applog(LOG_DEBUG, "Pushing submit work to work thread");
+		for (i = 0; i < found; i++) {
+			struct work *work = works[nonce_lanes[i]];
 
-	/* send solution to workio thread */
-	if (unlikely(!tq_push(thr_info[work_thr_id].q, wc))) {
-		applog(LOG_ERR, "Failed to tq_push work in submit_work_sync");
-		goto err_out;
+			if (opt_debug)
+				applog(LOG_DEBUG, "CPU %d found something?", dev_from_id(thr_id));
+			*(uint32_t *)(work->data + 64 + 12) = nonces[i];
+			if (unlikely(!submit_work_sync(mythr, work))) {
+				applog(LOG_ERR, "Failed to submit_work_sync in miner_thread %d", thr_id);
+				goto out;
+			}
+		}
+
+		for (l = 0; l < SCAN_LANES; l++) {
+			struct work *work = works[l];
+
+			timeval_subtract(&diff, &tv_end, &tv_workstart[l]);
+			if (!requested && (diff.tv_sec >= request_interval)) {
+				thread_reportout(mythr);
+				if (unlikely(!queue_request(mythr, false))) {
+					applog(LOG_ERR, "Failed to queue_request in miner_thread %d", thr_id);
+					goto out;
+				}
+				thread_reportin(mythr);
+				requested = true;
+			}
+
+			if (diff.tv_sec > opt_scantime ||
+			    work_restart[thr_id].restart || stale_work(work) ||
+			    work->blk.nonce >= work->nonce_end)
+				needs_work[l] = true;
+		}
+
+		if (unlikely(mythr->pause)) {
+			applog(LOG_WARNING, "Thread %d being disabled", thr_id);
+			mythr->rolling = mythr->cgpu->rolling = 0;
+			if (opt_debug)
+				applog(LOG_DEBUG, "Popping wakeup ping in miner thread");
+
+			thread_reportout(mythr);
+			tq_pop(mythr->q, NULL); /* Ignore ping that's popped */
+			thread_reportin(mythr);
+			applog(LOG_WARNING, "Thread %d being re-enabled", thr_id);
+		}
 	}
 
-	return true;
-err_out:
-	workio_cmd_free(wc);
-	return false;
-}
+out:
+	thread_reportin(mythr);
+	applog(LOG_ERR, "Thread %d failure, exiting", thr_id);
+	tq_freeze(mythr->q);
 
-bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
-{
-	work->data[64+12+0] = (nonce>>0) & 0xff;
-	work->data[64+12+1] = (nonce>>8) & 0xff;
-	work->data[64+12+2] = (nonce>>16) & 0xff;
-	work->data[64+12+3] = (nonce>>24) & 0xff;
-	/* Do one last check before attempting to submit the work */
-	if (!fulltest(work->data + 64, work->target))
-		return true;
-	return submit_work_sync(thr, work);
+	return NULL;
 }
+#endif
 
 static void *miner_thread(void *userdata)
 {
 	struct work *work = make_work();
 	struct thr_info *mythr = userdata;
 	const int thr_id = mythr->id;
-	uint32_t max_nonce = 0xffffff, total_hashes = 0;
+	uint32_t max_nonce = 0xffffff;
 	unsigned long hashes_done = max_nonce;
 	bool needs_work = true;
 	/* Try to cycle approximately 5 times before each log update */
 	const unsigned long cycle = opt_log_interval / 5 ? : 1;
 	unsigned const int request_interval = opt_scantime * 2 / 3 ? : 1;
 	bool requested = false;
-	uint32_t nonce_inc = max_nonce, hash_div = 1;
-	double hash_divfloat = 1.0;
+	uint32_t nonce_inc = max_nonce;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
@@ -3803,117 +5386,43 @@ static void *miner_thread(void *userdata)
 	if (!(opt_n_threads % num_processors))
 		affine_to_cpu(thr_id - gpu_threads, dev_from_id(thr_id));
 
+#ifdef WANT_SSE2_4WAY
+	if (opt_lane_pack && opt_algo == ALGO_4WAY) {
+		free_work(work);
+		return miner_thread_lanes(mythr);
+	}
+#endif
+
 	/* Invalidate pool so it fails can_roll() test */
 	work->pool = NULL;
 
 	while (1) {
 		struct timeval tv_workstart, tv_start, tv_end, diff;
+		uint32_t nonces[CPU_MAX_FOUND];
 		uint64_t max64;
-		bool rc;
+		int found, i;
 
 		if (needs_work) {
 			gettimeofday(&tv_workstart, NULL);
 			/* obtain new work from internal workio thread */
-			if (unlikely(!get_work(work, requested, mythr, thr_id, hash_div))) {
+			if (unlikely(!get_work(work, requested, mythr, thr_id, mythr->rolling))) {
 				applog(LOG_ERR, "work retrieval failed, exiting "
 					"mining thread %d", thr_id);
 				goto out;
 			}
 			needs_work = requested = false;
-			total_hashes = 0;
-			max_nonce = work->blk.nonce + hashes_done;
+			set_thread_chains(thr_id, &work, 1);
+			max64 = (uint64_t)work->blk.nonce + hashes_done;
+			max_nonce = max64 < work->nonce_end ? max64 : work->nonce_end;
 		}
 		hashes_done = 0;
 		gettimeofday(&tv_start, NULL);
 
-		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
-		case ALGO_C:
-			rc = scanhash_c(thr_id, work->midstate, work->data + 64,
-				        work->hash1, work->hash, work->target,
-					max_nonce, &hashes_done,
-					work->blk.nonce);
-			break;
-
-#ifdef WANT_X8632_SSE2
-		case ALGO_SSE2_32: {
-			unsigned int rc5 =
-			        scanhash_sse2_32(thr_id, work->midstate, work->data + 64,
-						 work->hash1, work->hash,
-						 work->target,
-					         max_nonce, &hashes_done,
-						 work->blk.nonce);
-			rc = (rc5 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_X8664_SSE2
-		case ALGO_SSE2_64: {
-			unsigned int rc5 =
-			        scanhash_sse2_64(thr_id, work->midstate, work->data + 64,
-						 work->hash1, work->hash,
-						 work->target,
-					         max_nonce, &hashes_done,
-						 work->blk.nonce);
-			rc = (rc5 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_X8664_SSE4
-		case ALGO_SSE4_64: {
-			unsigned int rc5 =
-			        scanhash_sse4_64(thr_id, work->midstate, work->data + 64,
-						 work->hash1, work->hash,
-						 work->target,
-					         max_nonce, &hashes_done,
-						 work->blk.nonce);
-			rc = (rc5 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_SSE2_4WAY
-		case ALGO_4WAY: {
-			unsigned int rc4 =
-				ScanHash_4WaySSE2(thr_id, work->midstate, work->data + 64,
-						  work->hash1, work->hash,
-						  work->target,
-						  max_nonce, &hashes_done,
-						  work->blk.nonce);
-			rc = (rc4 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_VIA_PADLOCK
-		case ALGO_VIA:
-			rc = scanhash_via(thr_id, work->data, work->target,
-					  max_nonce, &hashes_done,
-					  work->blk.nonce);
-			break;
-#endif
-		case ALGO_CRYPTOPP:
-			rc = scanhash_cryptopp(thr_id, work->midstate, work->data + 64,
-				        work->hash1, work->hash, work->target,
-					max_nonce, &hashes_done,
-					work->blk.nonce);
-			break;
-
-#ifdef WANT_CRYPTOPP_ASM32
-		case ALGO_CRYPTOPP_ASM32:
-			rc = scanhash_asm32(thr_id, work->midstate, work->data + 64,
-				        work->hash1, work->hash, work->target,
-					max_nonce, &hashes_done,
-					work->blk.nonce);
-			break;
-#endif
-
-		default:
-			/* should never happen */
+		/* scan nonces for proof-of-work hashes */
+		found = cpu_scanhash_bulk(thr_id, work, max_nonce, &hashes_done,
+					  nonces, CPU_MAX_FOUND);
+		if (unlikely(found < 0))
 			goto out;
-		}
 
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
@@ -3921,7 +5430,6 @@ static void *miner_thread(void *userdata)
 
 		hashes_done -= work->blk.nonce;
 		hashmeter(thr_id, &diff, hashes_done);
-		total_hashes += hashes_done;
 		work->blk.nonce += hashes_done;
 
 		/* adjust max_nonce to meet target cycle time */
@@ -3937,20 +5445,20 @@ static void *miner_thread(void *userdata)
 			nonce_inc = hashes_done * 2;
 		if (nonce_inc < 4)
 			nonce_inc = 0xffffff;
-		max64 = work->blk.nonce + nonce_inc;
-		if (max64 > 0xfffffffaULL)
-			max64 = 0xfffffffaULL;
+		max64 = (uint64_t)work->blk.nonce + nonce_inc;
+		if (max64 > work->nonce_end)
+			max64 = work->nonce_end;
 		max_nonce = max64;
 
-		/* if nonce found, submit work */
-		if (unlikely(rc)) {
+		/* if nonces found, submit them all as one batch */
+		for (i = 0; i < found; i++) {
 			if (opt_debug)
 				applog(LOG_DEBUG, "CPU %d found something?", dev_from_id(thr_id));
+			*(uint32_t *)(work->data + 64 + 12) = nonces[i];
 			if (unlikely(!submit_work_sync(mythr, work))) {
 				applog(LOG_ERR, "Failed to submit_work_sync in miner_thread %d", thr_id);
-				break;
+				goto out;
 			}
-			work->blk.nonce += 4;
 		}
 
 		timeval_subtract(&diff, &tv_end, &tv_workstart);
@@ -3964,13 +5472,10 @@ static void *miner_thread(void *userdata)
 			requested = true;
 		}
 
-		if (diff.tv_sec > opt_scantime) {
-			decay_time(&hash_divfloat , (double)((MAXTHREADS / total_hashes) ? : 1));
-			hash_div = hash_divfloat;
+		if (diff.tv_sec > opt_scantime ||
+		    work_restart[thr_id].restart || stale_work(work) ||
+		    work->blk.nonce >= work->nonce_end)
 			needs_work = true;
-		} else if (work_restart[thr_id].restart || stale_work(work) ||
-			work->blk.nonce >= MAXTHREADS - hashes_done)
-				needs_work = true;
 
 		if (unlikely(mythr->pause)) {
 			applog(LOG_WARNING, "Thread %d being disabled", thr_id);
@@ -4094,6 +5599,28 @@ static void set_threads_hashes(unsigned int vectors, unsigned int *threads,
 	*hashes = *threads * vectors;
 }
 
+/*
+ * Trim a dispatch to whole work groups that end within the work's nonce
+ * range, so the last one of a divided range doesn't scan into the next
+ * thread's.  False if not even one work group fits.
+ */
+static bool fit_threads_hashes(struct work *work, unsigned int vectors,
+			       unsigned int *threads, unsigned int *hashes,
+			       size_t *globalThreads, unsigned int minthreads)
+{
+	uint32_t left;
+
+	if (work->blk.nonce >= work->nonce_end)
+		return false;
+	left = (work->nonce_end - work->blk.nonce) / vectors;
+	if (left >= *threads)
+		return true;
+	*threads = left - left % minthreads;
+	*globalThreads = *threads;
+	*hashes = *threads * vectors;
+	return *threads > 0;
+}
+
 static void *gpuminer_thread(void *userdata)
 {
 	cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *);
@@ -4120,11 +5647,10 @@ static void *gpuminer_thread(void *userdata)
 	unsigned int hashes;
 	unsigned int hashes_done = 0;
 
-	/* Request the next work item at 2/3 of the scantime */
+	/* Request the next work item at 2/3 of the scantime or nonce range */
 	unsigned const int request_interval = opt_scantime * 2 / 3 ? : 1;
-	unsigned const long request_nonce = MAXTHREADS / 3 * 2;
+	uint32_t request_nonce;
 	bool requested = false;
-	uint32_t total_hashes = 0, hash_div = 1;
 
 	switch (chosen_kernel) {
 		case KL_POCLBM:
@@ -4174,14 +5700,14 @@ static void *gpuminer_thread(void *userdata)
 	tq_pop(mythr->q, NULL); /* Wait for a ping to start */
 	gettimeofday(&tv_workstart, NULL);
 	/* obtain new work from internal workio thread */
-	if (unlikely(!get_work(work, requested, mythr, thr_id, hash_div))) {
+	if (unlikely(!get_work(work, requested, mythr, thr_id, mythr->rolling))) {
 		applog(LOG_ERR, "work retrieval failed, exiting "
 			"gpu mining thread %d", thr_id);
 		goto out;
 	}
 	requested = false;
+	request_nonce = work->blk.nonce + (work->nonce_end - work->blk.nonce) / 3 * 2;
 	precalc_hash(&work->blk, (uint32_t *)(work->midstate), (uint32_t *)(work->data + 64));
-	work->blk.nonce = 0;
 
 	while (1) {
 		struct timeval tv_gpustart, tv_gpuend;
@@ -4210,7 +5736,8 @@ static void *gpuminer_thread(void *userdata)
 		set_threads_hashes(vectors, &threads, &hashes, globalThreads, localThreads[0]);
 
 		if (diff.tv_sec > opt_scantime ||
-		    work->blk.nonce >= MAXTHREADS - hashes ||
+		    !fit_threads_hashes(work, vectors, &threads, &hashes,
+					globalThreads, localThreads[0]) ||
 		    work_restart[thr_id].restart ||
 		    stale_work(work)) {
 			/* Ignore any reads since we're getting new work and queue a clean buffer */
@@ -4224,16 +5751,24 @@ static void *gpuminer_thread(void *userdata)
 			if (opt_debug)
 				applog(LOG_DEBUG, "getwork thread %d", thr_id);
 			/* obtain new work from internal workio thread */
-			if (unlikely(!get_work(work, requested, mythr, thr_id, hash_div))) {
+			if (unlikely(!get_work(work, requested, mythr, thr_id, mythr->rolling))) {
 				applog(LOG_ERR, "work retrieval failed, exiting "
 					"gpu mining thread %d", thr_id);
 				goto out;
 			}
 			requested = false;
+			set_thread_chains(thr_id, &work, 1);
+			request_nonce = work->blk.nonce + (work->nonce_end - work->blk.nonce) / 3 * 2;
 
 			precalc_hash(&work->blk, (uint32_t *)(work->midstate), (uint32_t *)(work->data + 64));
 			work_restart[thr_id].restart = 0;
 
+			/* Divided ranges are whole NONCE_CHUNKs, so at least a
+			 * work group always fits a fresh one */
+			set_threads_hashes(vectors, &threads, &hashes, globalThreads, localThreads[0]);
+			fit_threads_hashes(work, vectors, &threads, &hashes,
+					   globalThreads, localThreads[0]);
+
 			/* Flushes the writebuffer set with CL_FALSE above */
 			clFinish(clState->commandQueue);
 		}
@@ -4268,7 +5803,6 @@ static void *gpuminer_thread(void *userdata)
 		gettimeofday(&tv_end, NULL);
 		timeval_subtract(&diff, &tv_end, &tv_start);
 		hashes_done += hashes;
-		total_hashes += hashes;
 		work->blk.nonce += hashes;
 		if (diff.tv_sec >= cycle) {
 			hashmeter(thr_id, &diff, hashes_done);
@@ -4278,10 +5812,6 @@ static void *gpuminer_thread(void *userdata)
 
 		timeval_subtract(&diff, &tv_end, &tv_workstart);
 		if (!requested) {
-#if 0
-			if (diff.tv_sec > request_interval)
-				hash_div = (MAXTHREADS / total_hashes) ? : 1;
-#endif
 			if (diff.tv_sec > request_interval || work->blk.nonce > request_nonce) {
 				thread_reportout(mythr);
 				if (unlikely(!queue_request(mythr, false))) {
@@ -4318,24 +5848,43 @@ out:
 }
 #endif /* HAVE_OPENCL */
 
-/* Stage another work item from the work returned in a longpoll */
-static void convert_to_work(json_t *val, bool rolltime)
+/* Stage another work item from the work pool returned in a longpoll */
+static void convert_to_work(struct pool *pool, json_t *val, int rolltime)
 {
 	struct work *work;
-	bool rc;
+	bool rc, new_block;
 
 	work = make_work();
 
-	rc= work_decode(json_object_get(val, "result"), work);
+	rc = pool_decode(pool, json_object_get(val, "result"), work);
 	if (unlikely(!rc)) {
 		applog(LOG_ERR, "Could not convert longpoll data to work");
+		free_work(work);
 		return;
 	}
-	work->pool = current_pool();
-	work->rolltime = rolltime;
-	/* We'll be checking this work item twice, but we already know it's
-	 * from a new block so explicitly force the new block detection now
-	 * rather than waiting for it to hit the stage thread */
+	work->pool = pool;
+	work->rolltime = roll_time(rolltime);
+
+	/* A getblocktemplate long poll also returns when only the
+	 * transactions have changed */
+	rd_lock(&blk_lock);
+	new_block = !find_block(pool->chain, work->data + 4);
+	rd_unlock(&blk_lock);
+	if (new_block) {
+		/* Keep track of who ordered a restart_threads to make
+		 * sure it's only done once per new block */
+		if (pool->chain->changed != BLOCK_DETECT) {
+			pool->chain->changed = BLOCK_LP;
+			applog(LOG_WARNING, "LONGPOLL detected new block on network, waiting on fresh work");
+		} else {
+			applog(LOG_INFO, "LONGPOLL received after new block already detected");
+			pool->chain->changed = BLOCK_NONE;
+		}
+	} else
+		applog(LOG_INFO, "LONGPOLL returned an updated block template");
+
+	/* We'll be checking this work item twice, but force the new block
+	 * detection now rather than waiting for it to hit the stage thread */
 	test_work_current(work);
 
 	if (opt_debug)
@@ -4347,6 +5896,63 @@ static void convert_to_work(json_t *val, bool rolltime)
 		applog(LOG_DEBUG, "Converted longpoll data to work");
 }
 
+static const char *getauxblock_req =
+	"{\"method\": \"getauxblock\", \"params\": [], \"id\":0}\r\n";
+
+/* Move aux_block on to the aux chain's newest block, if it has one for us */
+static void aux_update(CURL *curl)
+{
+	static bool failing;
+	struct aux_block aux;
+	bool changed = false;
+	int rolltime;
+	json_t *val;
+
+	val = json_rpc_call(curl, aux_pool.rpc_url, aux_pool.rpc_userpass, getauxblock_req,
+			    false, false, &rolltime, &aux_pool);
+	if (val && aux_decode(json_object_get(val, "result"), &aux)) {
+		mutex_lock(&aux_pool.pool_lock);
+		if (!aux_block.id || memcmp(aux.hash, aux_block.hash, sizeof(aux.hash))) {
+			aux.id = aux_block.id + 1;
+			aux_block = aux;
+			changed = true;
+		}
+		mutex_unlock(&aux_pool.pool_lock);
+		if (changed)
+			applog(LOG_INFO, "New aux chain block to merge mine");
+		if (failing)
+			applog(LOG_WARNING, "Aux chain %s providing work again", aux_pool.rpc_url);
+		failing = false;
+	} else if (!failing) {
+		failing = true;
+		applog(LOG_WARNING, "Aux chain %s not providing work", aux_pool.rpc_url);
+	}
+	if (val)
+		json_decref(val);
+}
+
+/* Templates fetched after an aux block changes commit to the new one */
+static void *aux_thread(void *userdata)
+{
+	CURL *curl;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	pthread_detach(pthread_self());
+
+	curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialisation failed");
+		return NULL;
+	}
+
+	while (1) {
+		sleep(AUX_POLL);
+		aux_update(curl);
+	}
+
+	return NULL;
+}
+
 static void *longpoll_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
@@ -4366,6 +5972,9 @@ static void *longpoll_thread(void *userdata)
 	}
 
 	tq_pop(mythr->q, NULL);
+	/* stratum pools push new blocks down their own connection */
+	if (pool->has_stratum)
+		goto out;
 	if (!pool->hdr_path) {
 		applog(LOG_WARNING, "No long-poll found on this server");
 		goto out;
@@ -4396,24 +6005,21 @@ static void *longpoll_thread(void *userdata)
 
 	while (1) {
 		struct timeval start, end;
-		bool rolltime;
+		int rolltime;
 		json_t *val;
+		char *req;
 
+		req = work_lp_req(pool);
+		if (unlikely(!req)) {
+			applog(LOG_WARNING, "No long-poll id from %s", pool->rpc_url);
+			goto out;
+		}
 		gettimeofday(&start, NULL);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass, rpc_req,
+		val = json_rpc_call(curl, lp_url, pool->rpc_userpass, req,
 				    false, true, &rolltime, pool);
+		free(req);
 		if (likely(val)) {
-			/* Keep track of who ordered a restart_threads to make
-			 * sure it's only done once per new block */
-			if (block_changed != BLOCK_DETECT) {
-				block_changed = BLOCK_LP;
-				applog(LOG_WARNING, "LONGPOLL detected new block on network, waiting on fresh work");
-			} else {
-				applog(LOG_INFO, "LONGPOLL received after new block already detected");
-				block_changed = BLOCK_NONE;
-			}
-
-			convert_to_work(val, rolltime);
+			convert_to_work(pool, val, rolltime);
 			failures = 0;
 			json_decref(val);
 		} else {
@@ -4633,6 +6239,38 @@ static bool active_device(int thr_id)
 	return true;
 }
 
+/*
+ * Size the getwork prefetch depth from what the devices use up: each class
+ * (CPU, GPU) gets through its hashrate's worth of nonce space a second, and
+ * every work item expires after the scan time regardless.  Keep enough
+ * requests queued to cover twice the measured getwork latency at that rate,
+ * but never more than gets used before it goes stale, plus --queue extra.
+ */
+static void queue_control(void)
+{
+	double mhs[2] = { 0, 0 }, rate, depth;
+	int i, old = queue_depth;
+
+	if (!getwork_latency) {
+		queue_depth = mining_threads + opt_queue;
+		return;
+	}
+
+	for (i = 0; i < mining_threads; i++)
+		mhs[thr_info[i].cgpu->is_gpu ? 1 : 0] += thr_info[i].rolling;
+	rate = 1.0 / opt_scantime;
+	for (i = 0; i < 2; i++)
+		rate += mhs[i] * 1000000 / NONCE_END;
+
+	depth = rate * getwork_latency * 2;
+	if (depth > rate * opt_scantime)
+		depth = rate * opt_scantime;
+	queue_depth = ceil(depth) + opt_queue;
+	if (opt_debug && queue_depth != old)
+		applog(LOG_DEBUG, "Queue depth %d for %.0fms getwork latency",
+		       queue_depth, getwork_latency * 1000);
+}
+
 /* Makes sure the hashmeter keeps going even if mining threads stall, updates
  * the screen at regular intervals, and restarts threads if they appear to have
  * died. */
@@ -4652,7 +6290,8 @@ static void *watchdog_thread(void *userdata)
 		struct timeval now;
 
 		sleep(interval);
-		if (requests_queued() < opt_queue)
+		queue_control();
+		if (requests_queued() < queue_depth)
 			queue_request(NULL, false);
 
 		hashmeter(-1, &zero_tv, 0);
@@ -4794,6 +6433,7 @@ static void print_summary(void)
 	struct timeval diff;
 	int hours, mins, secs, i;
 	double utility, efficiency = 0.0;
+	unsigned int conn_new, conn_reused;
 
 	timeval_subtract(&diff, &total_tv_end, &total_tv_start);
 	hours = diff.tv_sec / 3600;
@@ -4825,7 +6465,25 @@ static void print_summary(void)
 	applog(LOG_WARNING, "Unable to get work from server occasions: %d", total_go);
 	applog(LOG_WARNING, "Work items generated locally: %d", local_work);
 	applog(LOG_WARNING, "Submitting work remotely delay occasions: %d", total_ro);
+	for (i = 0, conn_new = conn_reused = 0; i < total_pools; i++) {
+		conn_new += pools[i]->conn_new;
+		conn_reused += pools[i]->conn_reused;
+	}
+	if (conn_new + conn_reused)
+		applog(LOG_WARNING, "Connections reused: %u of %u requests (%.0f%%)",
+		       conn_reused, conn_new + conn_reused,
+		       conn_reused * 100.0 / (conn_new + conn_reused));
 	applog(LOG_WARNING, "New blocks detected on network: %d\n", new_blocks);
+	if (aux_pool.rpc_url)
+		applog(LOG_WARNING, "Aux chain blocks accepted: %d, rejected: %d\n",
+		       total_aux_accepted, total_aux_rejected);
+
+	for (i = 0; i < obj_pools_count(); i++) {
+		struct obj_pool *op = obj_pool_get(i);
+
+		applog(LOG_WARNING, "Object pool %s: %d in use, %d allocated, %d peak",
+		       op->name, op->in_use, op->total, op->high_water);
+	}
 
 	if (total_pools > 1) {
 		for (i = 0; i < total_pools; i++) {
@@ -4844,7 +6502,9 @@ static void print_summary(void)
 			applog(LOG_WARNING, " Discarded work due to new blocks: %d", pool->discarded_work);
 			applog(LOG_WARNING, " Stale submissions discarded due to new blocks: %d", pool->stale_shares);
 			applog(LOG_WARNING, " Unable to get work from server occasions: %d", pool->getfail_occasions);
-			applog(LOG_WARNING, " Submitting work remotely delay occasions: %d\n", pool->remotefail_occasions);
+			applog(LOG_WARNING, " Submitting work remotely delay occasions: %d", pool->remotefail_occasions);
+			applog(LOG_WARNING, " Connections reused: %u of %u requests\n",
+			       pool->conn_reused, pool->conn_new + pool->conn_reused);
 		}
 	}
 
@@ -4918,7 +6578,8 @@ static bool input_pool(bool live)
 		goto out;
 
 	if (strncmp(url, "http://", 7) &&
-	    strncmp(url, "https://", 8)) {
+	    strncmp(url, "https://", 8) &&
+	    strncmp(url, "stratum+tcp://", 14)) {
 		char *httpinput;
 
 		httpinput = malloc(255);
@@ -4943,9 +6604,11 @@ static bool input_pool(bool live)
 		quit(1, "Failed to realloc pools in input_pool");
 	pool->pool_no = total_pools;
 	pool->prio = total_pools;
+	pool->chain = &chains[0];
 	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL)))
 		quit (1, "Failed to pthread_mutex_init in input_pool");
 	pool->rpc_url = url;
+	pool->has_stratum = !strncmp(url, "stratum+tcp://", 14);
 	pool->rpc_user = user;
 	pool->rpc_pass = pass;
 	pool->rpc_userpass = malloc(strlen(pool->rpc_user) + strlen(pool->rpc_pass) + 2);
@@ -5082,6 +6745,7 @@ int main (int argc, char *argv[])
 	 * variables so do it before anything at all */
 	if (unlikely(curl_global_init(CURL_GLOBAL_ALL)))
 		quit(1, "Failed to curl_global_init");
+	net_start();
 
 	if (unlikely(pthread_mutex_init(&hash_lock, NULL)))
 		quit(1, "Failed to pthread_mutex_init");
@@ -5091,8 +6755,12 @@ int main (int argc, char *argv[])
 		quit(1, "Failed to pthread_mutex_init");
 	if (unlikely(pthread_mutex_init(&control_lock, NULL)))
 		quit(1, "Failed to pthread_mutex_init");
+	if (unlikely(pthread_mutex_init(&io_completed_lock, NULL)))
+		quit(1, "Failed to pthread_mutex_init");
 	if (unlikely(pthread_rwlock_init(&blk_lock, NULL)))
 		quit(1, "Failed to pthread_rwlock_init");
+	if (unlikely(pthread_mutex_init(&aux_pool.pool_lock, NULL)))
+		quit(1, "Failed to pthread_mutex_init");
 
 	sprintf(packagename, "%s %s", PACKAGE, VERSION);
 
@@ -5116,13 +6784,7 @@ int main (int argc, char *argv[])
 			skip_to_bench = 1;
 	#endif // defined(WIN32)
 
-	block = calloc(sizeof(struct block), 1);
-	if (unlikely(!block))
-		quit (1, "main OOM");
-	for (i = 0; i < 36; i++)
-		strcat(block->hash, "0");
-	HASH_ADD_STR(blocks, hash, block);
-	strcpy(current_block, block->hash);
+	find_chain("default");
 
 	// Reckon number of cores in the box
 	#if defined(WIN32)
@@ -5165,6 +6827,9 @@ int main (int argc, char *argv[])
 	}
 #endif
 
+	/* Before parsing, so --help shows it and --algo overrides it */
+	opt_algo = best_algo();
+
 	/* parse command line */
 	opt_register_table(opt_config_table,
 			   "Options for both config file and command line");
@@ -5189,7 +6854,7 @@ int main (int argc, char *argv[])
 		opt_log_output = true;
 
 	if (0<=opt_bench_algo) {
-		double rate = bench_algo_stage3(opt_bench_algo);
+		double rate = bench_algo_stage3(opt_bench_algo, opt_n_threads);
 		if (!skip_to_bench) {
 			printf("%.5f (%s)\n", rate, algo_names[opt_bench_algo]);
 		} else {
@@ -5255,6 +6920,9 @@ int main (int argc, char *argv[])
 	if (!opt_n_threads && ! gpu_threads)
 		quit(1, "All devices disabled, cannot mine!");
 
+	if (opt_algo_auto && opt_n_threads)
+		opt_algo = pick_algo_auto();
+
 	logcursor = 8;
 	gpucursor = logcursor;
 	cpucursor = gpucursor + nDevs;
@@ -5296,6 +6964,12 @@ int main (int argc, char *argv[])
 	/* Set the currentpool to pool 0 */
 	currentpool = pools[0];
 
+	if (aux_pool.rpc_url) {
+		if (!opt_gbt)
+			quit(1, "Merged mining with --aux-url needs --coinbase-addr");
+		aux_pool.pool_no = -1;
+	}
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog)
 		openlog(PACKAGE, LOG_PID, LOG_USER);
@@ -5307,8 +6981,9 @@ int main (int argc, char *argv[])
 	#endif // defined(unix)
 
 	mining_threads = opt_n_threads + gpu_threads;
+	queue_depth = mining_threads + opt_queue;
 
-	total_threads = mining_threads + 7;
+	total_threads = mining_threads + 8;
 	work_restart = calloc(total_threads, sizeof(*work_restart));
 	if (!work_restart)
 		quit(1, "Failed to calloc work_restart");
@@ -5353,6 +7028,21 @@ int main (int argc, char *argv[])
 		quit(1, "stage thread create failed");
 	pthread_detach(thr->pth);
 
+	/* Have the aux chain's block before any templates come in */
+	if (aux_pool.rpc_url) {
+		CURL *curl = curl_easy_init();
+
+		if (unlikely(!curl))
+			quit(1, "CURL initialisation failed");
+		aux_update(curl);
+		curl_easy_cleanup(curl);
+
+		aux_thr_id = mining_threads + 7;
+		thr = &thr_info[aux_thr_id];
+		if (thr_info_create(thr, NULL, aux_thread, thr))
+			quit(1, "aux thread create failed");
+	}
+
 	/* Create a unique get work queue */
 	getq = tq_new();
 	if (!getq)
@@ -5563,13 +7253,17 @@ int main (int argc, char *argv[])
 	if (opt_n_threads)
 		free(cpus);
 
-	HASH_ITER(hh, staged_work, work, tmpwork) {
-		HASH_DEL(staged_work, work);
+	list_for_each_entry_safe(work, tmpwork, &staged_work, list) {
+		unstage_work(work);
 		free_work(work);
 	}
-	HASH_ITER(hh, blocks, block, tmpblock) {
-		HASH_DEL(blocks, block);
-		free(block);
+	for (i = 0; i < total_chains; i++) {
+		list_for_each_entry_safe(block, tmpblock, &chains[i].blocks, list) {
+			list_del(&block->list);
+			free(block);
+		}
+		free(chains[i].hash);
+		free(chains[i].name);
 	}
 
 	curl_global_cleanup();
@@ -60,11 +60,33 @@ void *alloca (size_t);
  #include "ADL_SDK/adl_sdk.h"
 #endif
 
-#ifdef __SSE2__
+/*
+ * With GCC's target pragma every x86 kernel is built regardless of -march
+ * and the ones this CPU can run are picked at runtime, see cpu_features().
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__) && \
+    !defined(__clang__) && __GNUC__ >= 5
+#define WANT_CPU_DISPATCH 1
+#endif
+
+#if defined(__SSE2__) || defined(WANT_CPU_DISPATCH)
 #define WANT_SSE2_4WAY 1
 #endif
 
-#if defined(__i386__) && defined(HAS_YASM) && defined(__SSE2__)
+#if defined(__AVX2__) || defined(WANT_CPU_DISPATCH)
+#define WANT_AVX2_8WAY 1
+#endif
+
+#if defined(__AVX512F__) || defined(WANT_CPU_DISPATCH)
+#define WANT_AVX512_16WAY 1
+#endif
+
+#if defined(__SHA__) || defined(WANT_CPU_DISPATCH)
+#define WANT_SHANI 1
+#endif
+
+#if defined(__i386__) && defined(HAS_YASM) && \
+    (defined(__SSE2__) || defined(WANT_CPU_DISPATCH))
 #define WANT_X8632_SSE2 1
 #endif
 
@@ -213,10 +235,26 @@ struct cgpu_info {
 #endif
 };
 
+/* Slots in each thread_q ring; tq_push fails once this many are pending */
+#define TQ_SIZE 512
+
+struct tq_cell {
+	unsigned long		seq;
+	void			*data;
+};
+
 struct thread_q {
-	struct list_head	q;
+	struct tq_cell		cells[TQ_SIZE];
 
-	bool frozen;
+	/* Producers and consumers each get their own cache line */
+	unsigned long		head __attribute__((aligned(128)));
+	unsigned long		tail __attribute__((aligned(128)));
+
+	/* Bumped on every push, freeze and thaw; what poppers sleep on */
+	unsigned int		event __attribute__((aligned(128)));
+	int			waiters;
+
+	volatile bool frozen;
 
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
@@ -225,6 +263,7 @@ struct thread_q {
 struct thr_info {
 	int		id;
 	pthread_t	pth;
+	bool		started;	/* pth has not been cancelled yet */
 	struct thread_q	*q;
 	struct cgpu_info *cgpu;
 	struct timeval last;
@@ -306,6 +345,15 @@ static inline void wr_unlock(pthread_rwlock_t *lock)
 
 struct pool;
 
+/* what a pool's reusable curl handles are kept for */
+enum pool_curl {
+	POOL_CURL_GETWORK,
+	POOL_CURL_SUBMIT,
+	POOL_CURL_PURPOSES,
+};
+
+#define POOL_CURL_IDLE	8
+
 extern bool opt_debug;
 extern bool opt_protocol;
 extern bool opt_log_output;
@@ -315,17 +363,77 @@ extern bool opt_autofan;
 extern bool opt_autoengine;
 
 extern const uint32_t sha256_init_state[];
+extern void sha256(const unsigned char *ptr, size_t len, unsigned char *hash);
+extern void sha256_midstate(unsigned char *midstate, const unsigned char *data);
+extern void sha256_double(const unsigned char *midstate, const unsigned char *data,
+	const unsigned char *hash1, unsigned char *hash);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
-			     const char *rpc_req, bool, bool, bool *,
+			     const char *rpc_req, bool, bool, int *,
 			     struct pool *pool);
+typedef void (*json_rpc_cb)(json_t *val, int rolltime, void *arg);
+extern bool json_rpc_call_async(const char *url, const char *userpass,
+				const char *rpc_req, struct pool *pool,
+				enum pool_curl purpose, json_rpc_cb cb, void *arg);
+extern void json_rpc_deliver(json_t *val, json_rpc_cb cb, void *arg);
+#ifdef CURL_HAS_SOCKOPT
+extern int json_rpc_call_sockopt_cb(void *userdata, curl_socket_t fd, curlsocktype purpose);
+#endif
+extern void net_start(void);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
+/*
+ * The _bulk variants scan the whole range up to max_nonce and record every
+ * nonce meeting the target in nonces[], returning how many were found.
+ * They only stop early once max_found nonces have been recorded.
+ */
+extern int ScanHash_4WaySSE2_bulk(int, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce,
+	uint32_t *nonces, int max_found);
+
+extern int ScanHash_8WayAVX2_bulk(int, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce,
+	uint32_t *nonces, int max_found);
+
+extern int ScanHash_16WayAVX512_bulk(int, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce,
+	uint32_t *nonces, int max_found);
+
+#define SCAN_LANES 4
+
+/* One work item's slice of a lane-packed scan, one per SIMD lane */
+struct scan_lane {
+	const unsigned char	*midstate;
+	const unsigned char	*data;		/* second half of the header */
+	const unsigned char	*hash1;
+	const unsigned char	*target;
+	uint32_t		nonce;		/* next nonce to hash */
+};
+
+extern int ScanHash_4WaySSE2_lanes(int, struct scan_lane *lanes, uint32_t count,
+	unsigned long *nHashesDone, uint32_t *nonces, int *nonce_lanes, int max_found);
+
 extern unsigned int ScanHash_4WaySSE2(int, const unsigned char *pmidstate,
 	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce);
 
+extern unsigned int ScanHash_8WayAVX2(int, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce);
+
+extern unsigned int ScanHash_16WayAVX512(int, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone, uint32_t nonce);
+
 extern unsigned int scanhash_sse2_amd64(int, const unsigned char *pmidstate,
 	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
@@ -339,6 +447,14 @@ extern bool scanhash_c(int, const unsigned char *midstate, unsigned char *data,
 	      unsigned char *hash1, unsigned char *hash,
 	      const unsigned char *target,
 	      uint32_t max_nonce, unsigned long *hashes_done, uint32_t n);
+extern bool scanhash_c_precalc(int, const unsigned char *midstate, unsigned char *data,
+	      unsigned char *hash1, unsigned char *hash,
+	      const unsigned char *target,
+	      uint32_t max_nonce, unsigned long *hashes_done, uint32_t n);
+extern bool scanhash_shani(int, const unsigned char *midstate, unsigned char *data,
+	      unsigned char *hash1, unsigned char *hash,
+	      const unsigned char *target,
+	      uint32_t max_nonce, unsigned long *hashes_done, uint32_t n);
 extern bool scanhash_cryptopp(int, const unsigned char *midstate,unsigned char *data,
 	      unsigned char *hash1, unsigned char *hash,
 	      const unsigned char *target,
@@ -370,11 +486,23 @@ timeval_subtract (struct timeval *result, struct timeval *x, struct timeval *y);
 
 extern bool fulltest(const unsigned char *hash, const unsigned char *target);
 
+/* CPU features the SIMD kernels need, usable by the OS as well as the CPU */
+#define CPU_SSE2	(1 << 0)
+#define CPU_SSE4_1	(1 << 1)
+#define CPU_AVX2	(1 << 2)
+#define CPU_AVX512	(1 << 3)
+#define CPU_SHA		(1 << 4)
+
+extern unsigned int cpu_features(void);
+
 extern int opt_scantime;
 
+struct chain;
+
 struct work_restart {
 	volatile unsigned long	restart;
-	char			padding[128 - sizeof(unsigned long)];
+	volatile unsigned long	chains;		/* bit per chain its work is on */
+	char			padding[128 - 2 * sizeof(unsigned long)];
 };
 
 
@@ -413,6 +541,9 @@ typedef struct {
 } dev_blk_ctx;
 #endif
 
+/* Block templates kept per pool, so shares from older ones can be sent */
+#define GBT_KEEP 4
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -431,10 +562,39 @@ struct pool {
 	unsigned int getfail_occasions;
 	unsigned int remotefail_occasions;
 	struct timeval tv_idle;
+	int io_active;		/* getwork/submit requests in flight */
+	int io_submits;		/* shares waiting on io_pending or in flight */
+
+	/* idle handles kept for reuse, by purpose */
+	CURL *curl_idle[POOL_CURL_PURPOSES][POOL_CURL_IDLE];
+	int curl_nidle[POOL_CURL_PURPOSES];
+	unsigned int conn_new;		/* transfers that opened a connection */
+	unsigned int conn_reused;
+
+	struct work *roll_src;	/* newest rollable getwork, see roll_stage() */
+	struct gbt_tmpl *tmpl[GBT_KEEP];	/* recent block templates, by id */
+	unsigned int tmpl_id;
+
+	/* stratum+tcp:// pools push jobs over one persistent connection */
+	bool has_stratum;
+	bool stratum_started;	/* reader thread running */
+	bool stratum_up;	/* connected and subscribed */
+	bool stratum_ready;	/* holding a job to make work from */
+	int stratum_sock;
+	char *stratum_buf;	/* received, not yet a whole line */
+	size_t stratum_len, stratum_size;
+	char *nonce1;		/* extranonce1 hex from mining.subscribe */
+	int n2size;		/* extranonce2 bytes we roll */
+	double sdiff;		/* share difficulty */
+	int stratum_id;		/* last request id used, under pool_lock */
+	int stratum_auth_id;
+	struct list_head stratum_shares;	/* submitted, awaiting a response */
+	pthread_mutex_t stratum_lock;	/* serialises sends */
 
 	char *rpc_url;
 	char *rpc_userpass;
 	char *rpc_user, *rpc_pass;
+	struct chain *chain;	/* whose blocks this pool's work builds on */
 
 	pthread_mutex_t pool_lock;
 };
@@ -451,6 +611,7 @@ struct work {
 	uint32_t	output[1];
 	uint32_t	valid;
 	dev_blk_ctx	blk;
+	uint32_t	nonce_end;	/* scan blk.nonce up to here */
 
 	struct thr_info	*thr;
 	int		thr_id;
@@ -459,12 +620,69 @@ struct work {
 	bool		mined;
 	bool		clone;
 	bool		cloned;
-	bool		rolltime;
+	int		rolltime;	/* secs ntime may be rolled, 0 if not */
 
 	int		id;
-	UT_hash_handle hh;
+	struct block	*block;		/* block it was staged under */
+	unsigned int	epoch;		/* that block's epoch */
+	unsigned int	tmpl_id;	/* block template it was built from */
+	uint64_t	extranonce;	/* ...and its coinbase extranonce */
+	struct list_head list;		/* staged_work, oldest first */
+	struct list_head block_list;	/* block->staged */
 };
 
+/* An aux chain block from getauxblock, for merged mining */
+struct aux_block {
+	unsigned int	id;		/* which one, 0 for none */
+	unsigned char	hash[32];	/* as getauxblock shows it */
+	unsigned char	target[32];	/* little endian, as work->target */
+};
+
+/* A getblocktemplate response, turned into work locally by gbt_work() */
+struct gbt_tmpl {
+	unsigned int	id;
+	uint32_t	version;
+	unsigned char	prevhash[32];	/* header byte order */
+	uint32_t	curtime;
+	uint32_t	bits;
+	unsigned char	target[32];	/* little endian, as work->target */
+	struct timeval	tv_fetched;
+	uint64_t	extranonce;	/* last one handed out */
+	char		*job_id;	/* stratum job, NULL for getblocktemplate */
+	char		*lp_id;		/* BIP 22 longpollid, if the node has one */
+	char		*lp_uri;	/* where to long poll, if not the pool */
+
+	unsigned char	*coinbase;	/* without witness */
+	size_t		cb_len;
+	size_t		cb_xnonce;	/* offset of the extranonce in it */
+	int		xnonce_len;
+	bool		segwit;		/* coinbase carries a witness commitment */
+
+	unsigned char	(*branch)[32];	/* merkle branch of the coinbase */
+	int		nbranch;
+	char		*txdata;	/* hex of the other transactions */
+	int		ntx;
+
+	struct aux_block aux;		/* committed to in the coinbase */
+};
+
+extern bool gbt_payout_script(const char *addr, unsigned char *script, size_t *len);
+extern struct gbt_tmpl *gbt_decode(const json_t *res, const unsigned char *script,
+				   size_t script_len, const struct aux_block *aux);
+extern void gbt_free(struct gbt_tmpl *tmpl);
+extern void gbt_work(struct gbt_tmpl *tmpl, struct work *work);
+extern char *gbt_submit_req(const struct gbt_tmpl *tmpl, const struct work *work);
+extern void gbt_put_xnonce(unsigned char *p, uint64_t xnonce, int len);
+extern bool gbt_meets(const struct work *work, const unsigned char *target);
+extern bool aux_decode(const json_t *res, struct aux_block *aux);
+extern char *gbt_auxpow_req(const struct gbt_tmpl *tmpl, const struct work *work);
+
+extern bool stratum_connect(struct pool *pool);
+extern void stratum_disconnect(struct pool *pool);
+extern bool stratum_send(struct pool *pool, const char *s);
+extern json_t *stratum_recv(struct pool *pool);
+extern struct gbt_tmpl *stratum_decode(struct pool *pool, const json_t *params);
+
 enum cl_kernel {
 	KL_NONE,
 	KL_POCLBM,
@@ -479,6 +697,34 @@ extern void kill_work(void);
 extern void log_curses(int prio, const char *f, va_list ap);
 extern void vapplog(int prio, const char *fmt, va_list ap);
 extern void applog(int prio, const char *fmt, ...);
+/*
+ * Fixed-size object pools.  Each thread allocates from and frees to its own
+ * small cache, so an object freed on a different thread than allocated it
+ * simply joins that thread's cache; caches overflow to and refill from a
+ * shared per-pool depot.  Objects come back zeroed.
+ */
+struct obj_pool {
+	const char		*name;
+	size_t			size;
+	int			id;		/* slot in the per-thread caches */
+	pthread_mutex_t		lock;
+	void			*depot;		/* free objects linked through their first word */
+	int			nr_depot;
+	int			total;		/* objects carved from slabs so far */
+	int			in_use;
+	int			high_water;
+};
+
+#define OBJ_POOL(name, type) \
+	{ name, sizeof(type) < sizeof(void *) ? sizeof(void *) : sizeof(type), \
+	  -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0 }
+
+extern void *obj_alloc(struct obj_pool *pool);
+extern void obj_free(struct obj_pool *pool, void *obj);
+extern int obj_pools_count(void);
+extern struct obj_pool *obj_pool_get(int id);
+extern struct obj_pool work_pool;
+
 extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
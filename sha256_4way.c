@@ -16,6 +16,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef WANT_CPU_DISPATCH
+#pragma GCC target("sse2")
+#endif
+
 #define NPAR 32
 
 static void DoubleBlockSHA256(const void* pin, void* pout, const void* pinit, unsigned int hash[8][NPAR], const void* init2);
@@ -101,14 +105,15 @@ static const unsigned int pSHA256InitState[8] =
 {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 
 
-unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
+int ScanHash_4WaySSE2_bulk(int thr_id, const unsigned char *pmidstate,
 	unsigned char *pdata,
 	unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *nHashesDone,
-	uint32_t nonce)
+	uint32_t nonce, uint32_t *nonces, int max_found)
 {
     unsigned int *nNonce_p = (unsigned int*)(pdata + 12);
+    int found = 0;
 
     work_restart[thr_id].restart = 0;
 
@@ -126,15 +131,18 @@ unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
         {
             if (unlikely(thash[7][j] == 0))
             {
-		int i;
-
-                for (i = 0; i < 32/4; i++)
-                    ((unsigned int*)phash)[i] = thash[i][j];
+		/* The last rounds are skipped, so only H7 is finished */
+		*nNonce_p = nonce + j;
+		sha256_double(pmidstate, pdata, phash1, phash);
 
 		if (fulltest(phash, ptarget)) {
-			*nHashesDone = nonce;
-			*nNonce_p = nonce + j;
-                	return nonce + j;
+			nonces[found++] = nonce + j;
+			if (found == max_found) {
+				/* the next call steps NPAR on before hashing */
+				*nHashesDone = nonce + j + 1 - NPAR;
+				*nNonce_p = nonce + j;
+				return found;
+			}
 		}
             }
         }
@@ -142,63 +150,66 @@ unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
         if ((nonce >= max_nonce) || work_restart[thr_id].restart)
         {
             *nHashesDone = nonce;
-            return -1;
+            return found;
         }
     }
 }
 
-
-static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR], const void *init)
+unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
+	unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone,
+	uint32_t nonce)
 {
-    unsigned int* In = (unsigned int*)pin;
-    unsigned int* Pad = (unsigned int*)pad;
-    unsigned int* hPre = (unsigned int*)pre;
-    unsigned int* hInit = (unsigned int*)init;
-    unsigned int /* i, j, */ k;
+	uint32_t found;
+
+	if (ScanHash_4WaySSE2_bulk(thr_id, pmidstate, pdata, phash1, phash, ptarget,
+		    max_nonce, nHashesDone, nonce, &found, 1))
+		return found;
+	return -1;
+}
+
 
+/*
+ * Both hashes for four lanes at once.  in[] is the second half of the
+ * header (nonce already in in[3]) and pre[] the midstate, one vector per
+ * word, so the lanes need not share a work item.
+ */
+static inline __attribute__((always_inline)) void DoubleBlock4(const __m128i *in,
+    const __m128i *pre, const unsigned int *Pad, const unsigned int *hInit, __m128i *out)
+{
     /* vectors used in calculation */
     __m128i w0, w1, w2, w3, w4, w5, w6, w7;
     __m128i w8, w9, w10, w11, w12, w13, w14, w15;
     __m128i T1;
     __m128i a, b, c, d, e, f, g, h;
-    __m128i nonce, preNonce;
-
-    /* nonce offset for vector */
-    __m128i offset = _mm_set_epi32(0x00000003, 0x00000002, 0x00000001, 0x00000000);
-
-
-    preNonce = _mm_add_epi32(_mm_set1_epi32(In[3]), offset);
 
-    for(k = 0; k<NPAR; k+=4) {
-        w0 = _mm_set1_epi32(In[0]);
-        w1 = _mm_set1_epi32(In[1]);
-        w2 = _mm_set1_epi32(In[2]);
-        //w3 = _mm_set1_epi32(In[3]); nonce will be later hacked into the hash
-        w4 = _mm_set1_epi32(In[4]);
-        w5 = _mm_set1_epi32(In[5]);
-        w6 = _mm_set1_epi32(In[6]);
-        w7 = _mm_set1_epi32(In[7]);
-        w8 = _mm_set1_epi32(In[8]);
-        w9 = _mm_set1_epi32(In[9]);
-        w10 = _mm_set1_epi32(In[10]);
-        w11 = _mm_set1_epi32(In[11]);
-        w12 = _mm_set1_epi32(In[12]);
-        w13 = _mm_set1_epi32(In[13]);
-        w14 = _mm_set1_epi32(In[14]);
-        w15 = _mm_set1_epi32(In[15]);
-
-        /* hack nonce into lowest byte of w3 */
-	nonce = _mm_add_epi32(preNonce, _mm_set1_epi32(k));
-        w3 = nonce;
-
-        a = _mm_set1_epi32(hPre[0]);
-        b = _mm_set1_epi32(hPre[1]);
-        c = _mm_set1_epi32(hPre[2]);
-        d = _mm_set1_epi32(hPre[3]);
-        e = _mm_set1_epi32(hPre[4]);
-        f = _mm_set1_epi32(hPre[5]);
-        g = _mm_set1_epi32(hPre[6]);
-        h = _mm_set1_epi32(hPre[7]);
+        w0 = in[0];
+        w1 = in[1];
+        w2 = in[2];
+        w3 = in[3];
+        w4 = in[4];
+        w5 = in[5];
+        w6 = in[6];
+        w7 = in[7];
+        w8 = in[8];
+        w9 = in[9];
+        w10 = in[10];
+        w11 = in[11];
+        w12 = in[12];
+        w13 = in[13];
+        w14 = in[14];
+        w15 = in[15];
+
+        a = pre[0];
+        b = pre[1];
+        c = pre[2];
+        d = pre[3];
+        e = pre[4];
+        f = pre[5];
+        g = pre[6];
+        h = pre[7];
 
         SHA256ROUND(a, b, c, d, e, f, g, h, 0, w0);
         SHA256ROUND(h, a, b, c, d, e, f, g, 1, w1);
@@ -317,8 +328,7 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
         SHA256ROUND(b, c, d, e, f, g, h, a, 63, w15);
 
 #define store_load(x, i, dest) \
-        T1 = _mm_set1_epi32((hPre)[i]); \
-        dest = _mm_add_epi32(T1, x);
+        dest = _mm_add_epi32(pre[i], x);
 
         store_load(a, 0, w0);
         store_load(b, 1, w1);
@@ -470,7 +480,7 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
         /* store resulsts directly in thash */
 #define store_2(x,i)  \
         w0 = _mm_set1_epi32(hInit[i]); \
-        *(__m128i *)&(thash)[i][0+k] = _mm_add_epi32(w0, x);
+        out[i] = _mm_add_epi32(w0, x);
 
         store_2(a, 0);
         store_2(b, 1);
@@ -480,9 +490,94 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
         store_2(f, 5);
         store_2(g, 6);
         store_2(h, 7);
+}
+
+static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR], const void *init)
+{
+    unsigned int* In = (unsigned int*)pin;
+    unsigned int* Pad = (unsigned int*)pad;
+    unsigned int* hPre = (unsigned int*)pre;
+    unsigned int* hInit = (unsigned int*)init;
+    unsigned int i, k;
+    __m128i w[16], state[8], out[8];
+    __m128i nonce, preNonce;
+
+    /* nonce offset for vector */
+    __m128i offset = _mm_set_epi32(0x00000003, 0x00000002, 0x00000001, 0x00000000);
+
+    preNonce = _mm_add_epi32(_mm_set1_epi32(In[3]), offset);
+
+    for (i = 0; i < 16; i++)
+        w[i] = _mm_set1_epi32(In[i]);
+    for (i = 0; i < 8; i++)
+        state[i] = _mm_set1_epi32(hPre[i]);
+
+    for(k = 0; k<NPAR; k+=4) {
+        /* hack nonce into lowest byte of w3 */
+        nonce = _mm_add_epi32(preNonce, _mm_set1_epi32(k));
+        w[3] = nonce;
+
+        DoubleBlock4(w, state, Pad, hInit, out);
+
+        for (i = 0; i < 8; i++)
+            *(__m128i *)&(thash)[i][0+k] = out[i];
         *(__m128i *)&(thash)[8][0+k] = nonce;
     }
 
 }
 
+int ScanHash_4WaySSE2_lanes(int thr_id, struct scan_lane *lanes, uint32_t count,
+	unsigned long *nHashesDone, uint32_t *nonces, int *nonce_lanes, int max_found)
+{
+    const unsigned int *Pad = (const unsigned int *)lanes[0].hash1;
+    __m128i w[16], state[8], out[8], base;
+    uint32_t done = 0;
+    int found = 0, i, l;
+
+#define lane_word(p, i) (((const unsigned int *)(p))[i])
+#define lane_vec(f, i) _mm_set_epi32(lane_word(lanes[3].f, i), lane_word(lanes[2].f, i), \
+				     lane_word(lanes[1].f, i), lane_word(lanes[0].f, i))
+
+    work_restart[thr_id].restart = 0;
+
+    for (i = 0; i < 16; i++)
+        w[i] = lane_vec(data, i);
+    for (i = 0; i < 8; i++)
+        state[i] = lane_vec(midstate, i);
+    base = _mm_set_epi32(lanes[3].nonce, lanes[2].nonce, lanes[1].nonce, lanes[0].nonce);
+
+    while (done < count) {
+        int hits;
+
+        w[3] = _mm_add_epi32(base, _mm_set1_epi32(done));
+        DoubleBlock4(w, state, Pad, pSHA256InitState, out);
+        done++;
+
+        hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(out[7], _mm_setzero_si128())));
+        for (l = 0; unlikely(hits) && l < SCAN_LANES && found < max_found; l++) {
+            uint32_t data[16], hash[8], nonce = lanes[l].nonce + done - 1;
+
+            if (!(hits & (1 << l)))
+                continue;
+            /* The last rounds are skipped, so only H7 is finished */
+            memcpy(data, lanes[l].data, sizeof(data));
+            data[3] = nonce;
+            sha256_double(lanes[l].midstate, (unsigned char *)data, lanes[l].hash1,
+                          (unsigned char *)hash);
+            if (fulltest((unsigned char *)hash, lanes[l].target)) {
+                nonces[found] = nonce;
+                nonce_lanes[found++] = l;
+            }
+        }
+
+        if (unlikely(found == max_found || work_restart[thr_id].restart))
+            break;
+    }
+
+    for (l = 0; l < SCAN_LANES; l++)
+        lanes[l].nonce += done;
+    *nHashesDone = done;
+    return found;
+}
+
 #endif /* WANT_SSE2_4WAY */
@@ -0,0 +1,294 @@
+/*
+ * 8-way 256-bit AVX2 SHA-256, derived from tcatm's 4-way SSE2 code in
+ * sha256_4way.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+#include "miner.h"
+
+#ifdef WANT_AVX2_8WAY
+
+#include <string.h>
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#ifdef WANT_CPU_DISPATCH
+#pragma GCC target("avx2")
+#endif
+
+#define NPAR 32
+
+static const unsigned int sha256_consts[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const unsigned int pSHA256InitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static inline __m256i Ch(const __m256i b, const __m256i c, const __m256i d) {
+    return _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+}
+
+static inline __m256i Maj(const __m256i b, const __m256i c, const __m256i d) {
+    return _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+}
+
+#define ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define SHR(x, n)	_mm256_srli_epi32((x), (n))
+
+/* SHA256 Functions */
+#define BIGSIGMA0_256(x)    (_mm256_xor_si256(_mm256_xor_si256(ROTR((x), 2),ROTR((x), 13)),ROTR((x), 22)))
+#define BIGSIGMA1_256(x)    (_mm256_xor_si256(_mm256_xor_si256(ROTR((x), 6),ROTR((x), 11)),ROTR((x), 25)))
+
+#define SIGMA0_256(x)       (_mm256_xor_si256(_mm256_xor_si256(ROTR((x), 7),ROTR((x), 18)), SHR((x), 3 )))
+#define SIGMA1_256(x)       (_mm256_xor_si256(_mm256_xor_si256(ROTR((x),17),ROTR((x), 19)), SHR((x), 10)))
+
+#define add4(x0, x1, x2, x3) _mm256_add_epi32(_mm256_add_epi32(x0, x1),_mm256_add_epi32( x2,x3))
+#define add5(x0, x1, x2, x3, x4) _mm256_add_epi32(add4(x0, x1, x2, x3), x4)
+
+#define SHA256ROUND(a, b, c, d, e, f, g, h, i, w)                       \
+    T1 = add5(h, BIGSIGMA1_256(e), Ch(e, f, g), _mm256_set1_epi32(sha256_consts[i]), w);   \
+d = _mm256_add_epi32(d, T1);                                           \
+h = _mm256_add_epi32(T1, _mm256_add_epi32(BIGSIGMA0_256(a), Maj(a, b, c)));
+
+/* Message expansion for W[i], given the ring of the previous 16 words */
+#define EXPAND(w0, w1, w9, w14) \
+    w0 = add4(SIGMA1_256(w14), w9, SIGMA0_256(w1), w0)
+
+/* Rounds i..i+15 using the loaded or expanded message words as they are */
+#define ROUNDS16(i) \
+        SHA256ROUND(a, b, c, d, e, f, g, h, i + 0, w0); \
+        SHA256ROUND(h, a, b, c, d, e, f, g, i + 1, w1); \
+        SHA256ROUND(g, h, a, b, c, d, e, f, i + 2, w2); \
+        SHA256ROUND(f, g, h, a, b, c, d, e, i + 3, w3); \
+        SHA256ROUND(e, f, g, h, a, b, c, d, i + 4, w4); \
+        SHA256ROUND(d, e, f, g, h, a, b, c, i + 5, w5); \
+        SHA256ROUND(c, d, e, f, g, h, a, b, i + 6, w6); \
+        SHA256ROUND(b, c, d, e, f, g, h, a, i + 7, w7); \
+        SHA256ROUND(a, b, c, d, e, f, g, h, i + 8, w8); \
+        SHA256ROUND(h, a, b, c, d, e, f, g, i + 9, w9); \
+        SHA256ROUND(g, h, a, b, c, d, e, f, i + 10, w10); \
+        SHA256ROUND(f, g, h, a, b, c, d, e, i + 11, w11); \
+        SHA256ROUND(e, f, g, h, a, b, c, d, i + 12, w12); \
+        SHA256ROUND(d, e, f, g, h, a, b, c, i + 13, w13); \
+        SHA256ROUND(c, d, e, f, g, h, a, b, i + 14, w14); \
+        SHA256ROUND(b, c, d, e, f, g, h, a, i + 15, w15)
+
+/* Rounds i..i+12, expanding the message schedule as we go */
+#define XROUNDS13(i) \
+        EXPAND(w0, w1, w9, w14);   SHA256ROUND(a, b, c, d, e, f, g, h, i + 0, w0); \
+        EXPAND(w1, w2, w10, w15);  SHA256ROUND(h, a, b, c, d, e, f, g, i + 1, w1); \
+        EXPAND(w2, w3, w11, w0);   SHA256ROUND(g, h, a, b, c, d, e, f, i + 2, w2); \
+        EXPAND(w3, w4, w12, w1);   SHA256ROUND(f, g, h, a, b, c, d, e, i + 3, w3); \
+        EXPAND(w4, w5, w13, w2);   SHA256ROUND(e, f, g, h, a, b, c, d, i + 4, w4); \
+        EXPAND(w5, w6, w14, w3);   SHA256ROUND(d, e, f, g, h, a, b, c, i + 5, w5); \
+        EXPAND(w6, w7, w15, w4);   SHA256ROUND(c, d, e, f, g, h, a, b, i + 6, w6); \
+        EXPAND(w7, w8, w0, w5);    SHA256ROUND(b, c, d, e, f, g, h, a, i + 7, w7); \
+        EXPAND(w8, w9, w1, w6);    SHA256ROUND(a, b, c, d, e, f, g, h, i + 8, w8); \
+        EXPAND(w9, w10, w2, w7);   SHA256ROUND(h, a, b, c, d, e, f, g, i + 9, w9); \
+        EXPAND(w10, w11, w3, w8);  SHA256ROUND(g, h, a, b, c, d, e, f, i + 10, w10); \
+        EXPAND(w11, w12, w4, w9);  SHA256ROUND(f, g, h, a, b, c, d, e, i + 11, w11); \
+        EXPAND(w12, w13, w5, w10); SHA256ROUND(e, f, g, h, a, b, c, d, i + 12, w12)
+
+#define XROUNDS16(i) \
+        XROUNDS13(i); \
+        EXPAND(w13, w14, w6, w11); SHA256ROUND(d, e, f, g, h, a, b, c, i + 13, w13); \
+        EXPAND(w14, w15, w7, w12); SHA256ROUND(c, d, e, f, g, h, a, b, i + 14, w14); \
+        EXPAND(w15, w0, w8, w13);  SHA256ROUND(b, c, d, e, f, g, h, a, i + 15, w15)
+
+static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR], const void *init)
+{
+    unsigned int* In = (unsigned int*)pin;
+    unsigned int* Pad = (unsigned int*)pad;
+    unsigned int* hPre = (unsigned int*)pre;
+    unsigned int* hInit = (unsigned int*)init;
+    unsigned int k;
+
+    /* vectors used in calculation */
+    __m256i w0, w1, w2, w3, w4, w5, w6, w7;
+    __m256i w8, w9, w10, w11, w12, w13, w14, w15;
+    __m256i T1;
+    __m256i a, b, c, d, e, f, g, h;
+    __m256i nonce, preNonce;
+
+    /* nonce offset for vector */
+    __m256i offset = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    preNonce = _mm256_add_epi32(_mm256_set1_epi32(In[3]), offset);
+
+    for (k = 0; k < NPAR; k += 8) {
+        w0 = _mm256_set1_epi32(In[0]);
+        w1 = _mm256_set1_epi32(In[1]);
+        w2 = _mm256_set1_epi32(In[2]);
+        w4 = _mm256_set1_epi32(In[4]);
+        w5 = _mm256_set1_epi32(In[5]);
+        w6 = _mm256_set1_epi32(In[6]);
+        w7 = _mm256_set1_epi32(In[7]);
+        w8 = _mm256_set1_epi32(In[8]);
+        w9 = _mm256_set1_epi32(In[9]);
+        w10 = _mm256_set1_epi32(In[10]);
+        w11 = _mm256_set1_epi32(In[11]);
+        w12 = _mm256_set1_epi32(In[12]);
+        w13 = _mm256_set1_epi32(In[13]);
+        w14 = _mm256_set1_epi32(In[14]);
+        w15 = _mm256_set1_epi32(In[15]);
+
+        /* one nonce per lane in w3 */
+        nonce = _mm256_add_epi32(preNonce, _mm256_set1_epi32(k));
+        w3 = nonce;
+
+        a = _mm256_set1_epi32(hPre[0]);
+        b = _mm256_set1_epi32(hPre[1]);
+        c = _mm256_set1_epi32(hPre[2]);
+        d = _mm256_set1_epi32(hPre[3]);
+        e = _mm256_set1_epi32(hPre[4]);
+        f = _mm256_set1_epi32(hPre[5]);
+        g = _mm256_set1_epi32(hPre[6]);
+        h = _mm256_set1_epi32(hPre[7]);
+
+        ROUNDS16(0);
+        XROUNDS16(16);
+        XROUNDS16(32);
+        XROUNDS16(48);
+
+#define store_load(x, i, dest) \
+        T1 = _mm256_set1_epi32((hPre)[i]); \
+        dest = _mm256_add_epi32(T1, x);
+
+        store_load(a, 0, w0);
+        store_load(b, 1, w1);
+        store_load(c, 2, w2);
+        store_load(d, 3, w3);
+        store_load(e, 4, w4);
+        store_load(f, 5, w5);
+        store_load(g, 6, w6);
+        store_load(h, 7, w7);
+
+        w8 = _mm256_set1_epi32(Pad[8]);
+        w9 = _mm256_set1_epi32(Pad[9]);
+        w10 = _mm256_set1_epi32(Pad[10]);
+        w11 = _mm256_set1_epi32(Pad[11]);
+        w12 = _mm256_set1_epi32(Pad[12]);
+        w13 = _mm256_set1_epi32(Pad[13]);
+        w14 = _mm256_set1_epi32(Pad[14]);
+        w15 = _mm256_set1_epi32(Pad[15]);
+
+        a = _mm256_set1_epi32(hInit[0]);
+        b = _mm256_set1_epi32(hInit[1]);
+        c = _mm256_set1_epi32(hInit[2]);
+        d = _mm256_set1_epi32(hInit[3]);
+        e = _mm256_set1_epi32(hInit[4]);
+        f = _mm256_set1_epi32(hInit[5]);
+        g = _mm256_set1_epi32(hInit[6]);
+        h = _mm256_set1_epi32(hInit[7]);
+
+        ROUNDS16(0);
+        XROUNDS16(16);
+        XROUNDS16(32);
+        /* Skip last 3-rounds; not necessary for H==0 */
+        XROUNDS13(48);
+
+        /* store results directly in thash */
+#define store_2(x,i)  \
+        w0 = _mm256_set1_epi32(hInit[i]); \
+        _mm256_store_si256((__m256i *)&(thash)[i][0+k], _mm256_add_epi32(w0, x));
+
+        store_2(a, 0);
+        store_2(b, 1);
+        store_2(c, 2);
+        store_2(d, 3);
+        store_2(e, 4);
+        store_2(f, 5);
+        store_2(g, 6);
+        store_2(h, 7);
+        _mm256_store_si256((__m256i *)&(thash)[8][0+k], nonce);
+    }
+}
+
+int ScanHash_8WayAVX2_bulk(int thr_id, const unsigned char *pmidstate,
+	unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone,
+	uint32_t nonce, uint32_t *nonces, int max_found)
+{
+    unsigned int *nNonce_p = (unsigned int*)(pdata + 12);
+    int found = 0;
+
+    work_restart[thr_id].restart = 0;
+
+    for (;;)
+    {
+        unsigned int thash[9][NPAR] __attribute__((aligned(128)));
+	int j;
+
+	*nNonce_p = nonce;
+
+        DoubleBlockSHA256(pdata, phash1, pmidstate, thash, pSHA256InitState);
+
+        for (j = 0; j < NPAR; j++)
+        {
+            if (unlikely(thash[7][j] == 0))
+            {
+		/* The last rounds are skipped, so only H7 is finished */
+		*nNonce_p = nonce + j;
+		sha256_double(pmidstate, pdata, phash1, phash);
+
+		if (fulltest(phash, ptarget)) {
+			nonces[found++] = nonce + j;
+			if (found == max_found) {
+				*nHashesDone = nonce + j + 1;
+				*nNonce_p = nonce + j;
+				return found;
+			}
+		}
+            }
+        }
+
+	nonce += NPAR;
+
+        if ((nonce >= max_nonce) || work_restart[thr_id].restart)
+        {
+            *nHashesDone = nonce;
+            return found;
+        }
+    }
+}
+
+unsigned int ScanHash_8WayAVX2(int thr_id, const unsigned char *pmidstate,
+	unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, unsigned long *nHashesDone,
+	uint32_t nonce)
+{
+	uint32_t found;
+
+	if (ScanHash_8WayAVX2_bulk(thr_id, pmidstate, pdata, phash1, phash, ptarget,
+		    max_nonce, nHashesDone, nonce, &found, 1))
+		return found;
+	return -1;
+}
+
+#endif /* WANT_AVX2_8WAY */
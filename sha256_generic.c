@@ -238,6 +238,57 @@ const uint32_t sha256_init_state[8] = {
 	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
 };
 
+/* SHA-256 of a plain byte string, for work built locally */
+void sha256(const unsigned char *ptr, size_t len, unsigned char *hash)
+{
+	uint32_t state[8], block[16];
+	unsigned char tail[128];
+	size_t left, i;
+	int blocks;
+
+	memcpy(state, sha256_init_state, sizeof(state));
+	for (left = len; left >= 64; left -= 64, ptr += 64) {
+		memcpy(block, ptr, 64);
+		for (i = 0; i < 16; i++)
+			block[i] = be32toh(block[i]);
+		sha256_transform(state, (u8 *)block);
+	}
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, ptr, left);
+	tail[left] = 0x80;
+	blocks = left < 56 ? 1 : 2;
+	for (i = 0; i < 8; i++)
+		tail[blocks * 64 - 1 - i] = ((uint64_t)len * 8) >> (i * 8);
+	for (ptr = tail; blocks--; ptr += 64) {
+		memcpy(block, ptr, 64);
+		for (i = 0; i < 16; i++)
+			block[i] = be32toh(block[i]);
+		sha256_transform(state, (u8 *)block);
+	}
+
+	for (i = 0; i < 8; i++)
+		state[i] = htobe32(state[i]);
+	memcpy(hash, state, 32);
+}
+
+/* The midstate of a work item's data, as getwork would have sent it */
+void sha256_midstate(unsigned char *midstate, const unsigned char *data)
+{
+	runhash(midstate, data, sha256_init_state);
+}
+
+/* Both hashes of a header in full, for kernels that only finish H7 */
+void sha256_double(const unsigned char *midstate, const unsigned char *data,
+		   const unsigned char *hash1, unsigned char *hash)
+{
+	uint32_t buf[16];
+
+	memcpy(buf, hash1, sizeof(buf));
+	runhash(buf, data, midstate);
+	runhash(hash, buf, sha256_init_state);
+}
+
 /* suspiciously similar to ScanHash* from bitcoin */
 bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 	        unsigned char *hash1, unsigned char *hash,
@@ -272,3 +323,423 @@ bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 	}
 }
 
+
+/*
+ * scanhash_c with the nonce-invariant work hoisted out of the loop, along
+ * the lines of precalc_hash() in findnonce.c: rounds 0-2 and W16-W19 of
+ * the first transform are done once per call, the fixed header and hash1
+ * padding words are folded into the constants, and the second transform
+ * stops after round 60, where h already holds the final H7.
+ */
+bool scanhash_c_precalc(int thr_id, const unsigned char *midstate, unsigned char *data,
+	        unsigned char *hash1, unsigned char *hash,
+		const unsigned char *target,
+	        uint32_t max_nonce, unsigned long *hashes_done,
+		uint32_t n)
+{
+	const u32 *state = (const u32 *) midstate;
+	u32 *in = (u32 *) data;
+	u32 *nonce = &in[3];
+	u32 pa, pb, pc, pd, pe, pf, pg, ph;
+	u32 a, b, c, d, e, f, g, h, t1, t2;
+	u32 W0, W1, W2, W16, W17, p18, p19, t13, t23;
+	u32 W[64];
+
+	work_restart[thr_id].restart = 0;
+
+	W0 = in[0];
+	W1 = in[1];
+	W2 = in[2];
+	W16 = s0(W1) + W0;
+	W17 = s0(W2) + W1 + 0x01100000;
+	p18 = s1(W16) + W2;
+	p19 = s1(W17) + 0x11002000;
+
+	a=state[0];  b=state[1];  c=state[2];  d=state[3];
+	e=state[4];  f=state[5];  g=state[6];  h=state[7];
+
+	t1 = h + e1(e) + Ch(e,f,g) + 0x428a2f98 + W0;
+	t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+	t1 = g + e1(d) + Ch(d,e,f) + 0x71374491 + W1;
+	t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+	t1 = f + e1(c) + Ch(c,d,e) + 0xb5c0fbcf + W2;
+	t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+
+	t13 = e + e1(b) + Ch(b,c,d) + 0xe9b5dba5;
+	t23 = e0(f) + Maj(f,g,h);
+
+	pa = a;  pb = b;  pc = c;  pd = d;
+	pe = e;  pf = f;  pg = g;  ph = h;
+
+	while (1) {
+		n++;
+		*nonce = n;
+
+		a = pa;  b = pb;  c = pc;  d = pd;
+		e = pe;  f = pf;  g = pg;  h = ph;
+
+		/* round 3 is the first to see the nonce */
+		t1 = t13 + n;
+		a+=t1;    e=t1+t23;
+		t1 = d + e1(a) + Ch(a,b,c) + 0xb956c25b;
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		t1 = c + e1(h) + Ch(h,a,b) + 0x59f111f1;
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x923f82a4;
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		t1 = a + e1(f) + Ch(f,g,h) + 0xab1c5ed5;
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		t1 = h + e1(e) + Ch(e,f,g) + 0xd807aa98;
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		t1 = g + e1(d) + Ch(d,e,f) + 0x12835b01;
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		t1 = f + e1(c) + Ch(c,d,e) + 0x243185be;
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		t1 = e + e1(b) + Ch(b,c,d) + 0x550c7dc3;
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		t1 = d + e1(a) + Ch(a,b,c) + 0x72be5d74;
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		t1 = c + e1(h) + Ch(h,a,b) + 0x80deb1fe;
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x9bdc06a7;
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		t1 = a + e1(f) + Ch(f,g,h) + 0xc19bf3f4;
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		t1 = h + e1(e) + Ch(e,f,g) + 0xe49b69c1 + W16;
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		t1 = g + e1(d) + Ch(d,e,f) + 0xefbe4786 + W17;
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[18] = p18 + s0(n);
+		t1 = f + e1(c) + Ch(c,d,e) + 0x0fc19dc6 + W[18];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[19] = p19 + n;
+		t1 = e + e1(b) + Ch(b,c,d) + 0x240ca1cc + W[19];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[20] = s1(W[18]) + 0x80000000;
+		t1 = d + e1(a) + Ch(a,b,c) + 0x2de92c6f + W[20];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[21] = s1(W[19]);
+		t1 = c + e1(h) + Ch(h,a,b) + 0x4a7484aa + W[21];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[22] = s1(W[20]) + 0x00000280;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x5cb0a9dc + W[22];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[23] = s1(W[21]) + W16;
+		t1 = a + e1(f) + Ch(f,g,h) + 0x76f988da + W[23];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[24] = s1(W[22]) + W17;
+		t1 = h + e1(e) + Ch(e,f,g) + 0x983e5152 + W[24];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[25] = s1(W[23]) + W[18];
+		t1 = g + e1(d) + Ch(d,e,f) + 0xa831c66d + W[25];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[26] = s1(W[24]) + W[19];
+		t1 = f + e1(c) + Ch(c,d,e) + 0xb00327c8 + W[26];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[27] = s1(W[25]) + W[20];
+		t1 = e + e1(b) + Ch(b,c,d) + 0xbf597fc7 + W[27];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[28] = s1(W[26]) + W[21];
+		t1 = d + e1(a) + Ch(a,b,c) + 0xc6e00bf3 + W[28];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[29] = s1(W[27]) + W[22];
+		t1 = c + e1(h) + Ch(h,a,b) + 0xd5a79147 + W[29];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[30] = s1(W[28]) + W[23] + 0x00a00055;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x06ca6351 + W[30];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[31] = s1(W[29]) + W[24] + s0(W16) + 0x00000280;
+		t1 = a + e1(f) + Ch(f,g,h) + 0x14292967 + W[31];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[32] = s1(W[30]) + W[25] + s0(W17) + W16;
+		t1 = h + e1(e) + Ch(e,f,g) + 0x27b70a85 + W[32];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[33] = s1(W[31]) + W[26] + s0(W[18]) + W17;
+		t1 = g + e1(d) + Ch(d,e,f) + 0x2e1b2138 + W[33];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[34] = s1(W[32]) + W[27] + s0(W[19]) + W[18];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x4d2c6dfc + W[34];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[35] = s1(W[33]) + W[28] + s0(W[20]) + W[19];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x53380d13 + W[35];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[36] = s1(W[34]) + W[29] + s0(W[21]) + W[20];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x650a7354 + W[36];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[37] = s1(W[35]) + W[30] + s0(W[22]) + W[21];
+		t1 = c + e1(h) + Ch(h,a,b) + 0x766a0abb + W[37];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[38] = s1(W[36]) + W[31] + s0(W[23]) + W[22];
+		t1 = b + e1(g) + Ch(g,h,a) + 0x81c2c92e + W[38];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[39] = s1(W[37]) + W[32] + s0(W[24]) + W[23];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x92722c85 + W[39];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[40] = s1(W[38]) + W[33] + s0(W[25]) + W[24];
+		t1 = h + e1(e) + Ch(e,f,g) + 0xa2bfe8a1 + W[40];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[41] = s1(W[39]) + W[34] + s0(W[26]) + W[25];
+		t1 = g + e1(d) + Ch(d,e,f) + 0xa81a664b + W[41];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[42] = s1(W[40]) + W[35] + s0(W[27]) + W[26];
+		t1 = f + e1(c) + Ch(c,d,e) + 0xc24b8b70 + W[42];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[43] = s1(W[41]) + W[36] + s0(W[28]) + W[27];
+		t1 = e + e1(b) + Ch(b,c,d) + 0xc76c51a3 + W[43];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[44] = s1(W[42]) + W[37] + s0(W[29]) + W[28];
+		t1 = d + e1(a) + Ch(a,b,c) + 0xd192e819 + W[44];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[45] = s1(W[43]) + W[38] + s0(W[30]) + W[29];
+		t1 = c + e1(h) + Ch(h,a,b) + 0xd6990624 + W[45];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[46] = s1(W[44]) + W[39] + s0(W[31]) + W[30];
+		t1 = b + e1(g) + Ch(g,h,a) + 0xf40e3585 + W[46];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[47] = s1(W[45]) + W[40] + s0(W[32]) + W[31];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x106aa070 + W[47];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[48] = s1(W[46]) + W[41] + s0(W[33]) + W[32];
+		t1 = h + e1(e) + Ch(e,f,g) + 0x19a4c116 + W[48];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[49] = s1(W[47]) + W[42] + s0(W[34]) + W[33];
+		t1 = g + e1(d) + Ch(d,e,f) + 0x1e376c08 + W[49];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[50] = s1(W[48]) + W[43] + s0(W[35]) + W[34];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x2748774c + W[50];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[51] = s1(W[49]) + W[44] + s0(W[36]) + W[35];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x34b0bcb5 + W[51];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[52] = s1(W[50]) + W[45] + s0(W[37]) + W[36];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x391c0cb3 + W[52];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[53] = s1(W[51]) + W[46] + s0(W[38]) + W[37];
+		t1 = c + e1(h) + Ch(h,a,b) + 0x4ed8aa4a + W[53];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[54] = s1(W[52]) + W[47] + s0(W[39]) + W[38];
+		t1 = b + e1(g) + Ch(g,h,a) + 0x5b9cca4f + W[54];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[55] = s1(W[53]) + W[48] + s0(W[40]) + W[39];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x682e6ff3 + W[55];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[56] = s1(W[54]) + W[49] + s0(W[41]) + W[40];
+		t1 = h + e1(e) + Ch(e,f,g) + 0x748f82ee + W[56];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[57] = s1(W[55]) + W[50] + s0(W[42]) + W[41];
+		t1 = g + e1(d) + Ch(d,e,f) + 0x78a5636f + W[57];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[58] = s1(W[56]) + W[51] + s0(W[43]) + W[42];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x84c87814 + W[58];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[59] = s1(W[57]) + W[52] + s0(W[44]) + W[43];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x8cc70208 + W[59];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[60] = s1(W[58]) + W[53] + s0(W[45]) + W[44];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x90befffa + W[60];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[61] = s1(W[59]) + W[54] + s0(W[46]) + W[45];
+		t1 = c + e1(h) + Ch(h,a,b) + 0xa4506ceb + W[61];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[62] = s1(W[60]) + W[55] + s0(W[47]) + W[46];
+		t1 = b + e1(g) + Ch(g,h,a) + 0xbef9a3f7 + W[62];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[63] = s1(W[61]) + W[56] + s0(W[48]) + W[47];
+		t1 = a + e1(f) + Ch(f,g,h) + 0xc67178f2 + W[63];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+
+		W[0] = state[0] + a;
+		W[1] = state[1] + b;
+		W[2] = state[2] + c;
+		W[3] = state[3] + d;
+		W[4] = state[4] + e;
+		W[5] = state[5] + f;
+		W[6] = state[6] + g;
+		W[7] = state[7] + h;
+
+		a = 0x6a09e667;  b = 0xbb67ae85;  c = 0x3c6ef372;  d = 0xa54ff53a;
+		e = 0x510e527f;  f = 0x9b05688c;  g = 0x1f83d9ab;  h = 0x5be0cd19;
+
+		t1 = h + e1(e) + Ch(e,f,g) + 0x428a2f98 + W[0];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		t1 = g + e1(d) + Ch(d,e,f) + 0x71374491 + W[1];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		t1 = f + e1(c) + Ch(c,d,e) + 0xb5c0fbcf + W[2];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		t1 = e + e1(b) + Ch(b,c,d) + 0xe9b5dba5 + W[3];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		t1 = d + e1(a) + Ch(a,b,c) + 0x3956c25b + W[4];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		t1 = c + e1(h) + Ch(h,a,b) + 0x59f111f1 + W[5];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x923f82a4 + W[6];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		t1 = a + e1(f) + Ch(f,g,h) + 0xab1c5ed5 + W[7];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		t1 = h + e1(e) + Ch(e,f,g) + 0x5807aa98;
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		t1 = g + e1(d) + Ch(d,e,f) + 0x12835b01;
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		t1 = f + e1(c) + Ch(c,d,e) + 0x243185be;
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		t1 = e + e1(b) + Ch(b,c,d) + 0x550c7dc3;
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		t1 = d + e1(a) + Ch(a,b,c) + 0x72be5d74;
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		t1 = c + e1(h) + Ch(h,a,b) + 0x80deb1fe;
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x9bdc06a7;
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		t1 = a + e1(f) + Ch(f,g,h) + 0xc19bf274;
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[16] = s0(W[1]) + W[0];
+		t1 = h + e1(e) + Ch(e,f,g) + 0xe49b69c1 + W[16];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[17] = s0(W[2]) + W[1] + 0x00a00000;
+		t1 = g + e1(d) + Ch(d,e,f) + 0xefbe4786 + W[17];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[18] = s1(W[16]) + s0(W[3]) + W[2];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x0fc19dc6 + W[18];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[19] = s1(W[17]) + s0(W[4]) + W[3];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x240ca1cc + W[19];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[20] = s1(W[18]) + s0(W[5]) + W[4];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x2de92c6f + W[20];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[21] = s1(W[19]) + s0(W[6]) + W[5];
+		t1 = c + e1(h) + Ch(h,a,b) + 0x4a7484aa + W[21];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[22] = s1(W[20]) + s0(W[7]) + W[6] + 0x00000100;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x5cb0a9dc + W[22];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[23] = s1(W[21]) + W[16] + W[7] + 0x11002000;
+		t1 = a + e1(f) + Ch(f,g,h) + 0x76f988da + W[23];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[24] = s1(W[22]) + W[17] + 0x80000000;
+		t1 = h + e1(e) + Ch(e,f,g) + 0x983e5152 + W[24];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[25] = s1(W[23]) + W[18];
+		t1 = g + e1(d) + Ch(d,e,f) + 0xa831c66d + W[25];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[26] = s1(W[24]) + W[19];
+		t1 = f + e1(c) + Ch(c,d,e) + 0xb00327c8 + W[26];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[27] = s1(W[25]) + W[20];
+		t1 = e + e1(b) + Ch(b,c,d) + 0xbf597fc7 + W[27];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[28] = s1(W[26]) + W[21];
+		t1 = d + e1(a) + Ch(a,b,c) + 0xc6e00bf3 + W[28];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[29] = s1(W[27]) + W[22];
+		t1 = c + e1(h) + Ch(h,a,b) + 0xd5a79147 + W[29];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[30] = s1(W[28]) + W[23] + 0x00400022;
+		t1 = b + e1(g) + Ch(g,h,a) + 0x06ca6351 + W[30];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[31] = s1(W[29]) + W[24] + s0(W[16]) + 0x00000100;
+		t1 = a + e1(f) + Ch(f,g,h) + 0x14292967 + W[31];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[32] = s1(W[30]) + W[25] + s0(W[17]) + W[16];
+		t1 = h + e1(e) + Ch(e,f,g) + 0x27b70a85 + W[32];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[33] = s1(W[31]) + W[26] + s0(W[18]) + W[17];
+		t1 = g + e1(d) + Ch(d,e,f) + 0x2e1b2138 + W[33];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[34] = s1(W[32]) + W[27] + s0(W[19]) + W[18];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x4d2c6dfc + W[34];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[35] = s1(W[33]) + W[28] + s0(W[20]) + W[19];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x53380d13 + W[35];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[36] = s1(W[34]) + W[29] + s0(W[21]) + W[20];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x650a7354 + W[36];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[37] = s1(W[35]) + W[30] + s0(W[22]) + W[21];
+		t1 = c + e1(h) + Ch(h,a,b) + 0x766a0abb + W[37];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[38] = s1(W[36]) + W[31] + s0(W[23]) + W[22];
+		t1 = b + e1(g) + Ch(g,h,a) + 0x81c2c92e + W[38];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[39] = s1(W[37]) + W[32] + s0(W[24]) + W[23];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x92722c85 + W[39];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[40] = s1(W[38]) + W[33] + s0(W[25]) + W[24];
+		t1 = h + e1(e) + Ch(e,f,g) + 0xa2bfe8a1 + W[40];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[41] = s1(W[39]) + W[34] + s0(W[26]) + W[25];
+		t1 = g + e1(d) + Ch(d,e,f) + 0xa81a664b + W[41];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[42] = s1(W[40]) + W[35] + s0(W[27]) + W[26];
+		t1 = f + e1(c) + Ch(c,d,e) + 0xc24b8b70 + W[42];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[43] = s1(W[41]) + W[36] + s0(W[28]) + W[27];
+		t1 = e + e1(b) + Ch(b,c,d) + 0xc76c51a3 + W[43];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[44] = s1(W[42]) + W[37] + s0(W[29]) + W[28];
+		t1 = d + e1(a) + Ch(a,b,c) + 0xd192e819 + W[44];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[45] = s1(W[43]) + W[38] + s0(W[30]) + W[29];
+		t1 = c + e1(h) + Ch(h,a,b) + 0xd6990624 + W[45];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[46] = s1(W[44]) + W[39] + s0(W[31]) + W[30];
+		t1 = b + e1(g) + Ch(g,h,a) + 0xf40e3585 + W[46];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[47] = s1(W[45]) + W[40] + s0(W[32]) + W[31];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x106aa070 + W[47];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[48] = s1(W[46]) + W[41] + s0(W[33]) + W[32];
+		t1 = h + e1(e) + Ch(e,f,g) + 0x19a4c116 + W[48];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[49] = s1(W[47]) + W[42] + s0(W[34]) + W[33];
+		t1 = g + e1(d) + Ch(d,e,f) + 0x1e376c08 + W[49];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[50] = s1(W[48]) + W[43] + s0(W[35]) + W[34];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x2748774c + W[50];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[51] = s1(W[49]) + W[44] + s0(W[36]) + W[35];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x34b0bcb5 + W[51];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[52] = s1(W[50]) + W[45] + s0(W[37]) + W[36];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x391c0cb3 + W[52];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+		W[53] = s1(W[51]) + W[46] + s0(W[38]) + W[37];
+		t1 = c + e1(h) + Ch(h,a,b) + 0x4ed8aa4a + W[53];
+		t2 = e0(d) + Maj(d,e,f);    g+=t1;    c=t1+t2;
+		W[54] = s1(W[52]) + W[47] + s0(W[39]) + W[38];
+		t1 = b + e1(g) + Ch(g,h,a) + 0x5b9cca4f + W[54];
+		t2 = e0(c) + Maj(c,d,e);    f+=t1;    b=t1+t2;
+		W[55] = s1(W[53]) + W[48] + s0(W[40]) + W[39];
+		t1 = a + e1(f) + Ch(f,g,h) + 0x682e6ff3 + W[55];
+		t2 = e0(b) + Maj(b,c,d);    e+=t1;    a=t1+t2;
+		W[56] = s1(W[54]) + W[49] + s0(W[41]) + W[40];
+		t1 = h + e1(e) + Ch(e,f,g) + 0x748f82ee + W[56];
+		t2 = e0(a) + Maj(a,b,c);    d+=t1;    h=t1+t2;
+		W[57] = s1(W[55]) + W[50] + s0(W[42]) + W[41];
+		t1 = g + e1(d) + Ch(d,e,f) + 0x78a5636f + W[57];
+		t2 = e0(h) + Maj(h,a,b);    c+=t1;    g=t1+t2;
+		W[58] = s1(W[56]) + W[51] + s0(W[43]) + W[42];
+		t1 = f + e1(c) + Ch(c,d,e) + 0x84c87814 + W[58];
+		t2 = e0(g) + Maj(g,h,a);    b+=t1;    f=t1+t2;
+		W[59] = s1(W[57]) + W[52] + s0(W[44]) + W[43];
+		t1 = e + e1(b) + Ch(b,c,d) + 0x8cc70208 + W[59];
+		t2 = e0(f) + Maj(f,g,h);    a+=t1;    e=t1+t2;
+		W[60] = s1(W[58]) + W[53] + s0(W[45]) + W[44];
+		t1 = d + e1(a) + Ch(a,b,c) + 0x90befffa + W[60];
+		t2 = e0(e) + Maj(e,f,g);    h+=t1;    d=t1+t2;
+
+		if (unlikely(h + 0x5be0cd19 == 0)) {
+			runhash(hash1, data, midstate);
+			runhash(hash, hash1, sha256_init_state);
+			if (fulltest(hash, target)) {
+				*hashes_done = n;
+				return true;
+			}
+		}
+
+		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+			*hashes_done = n;
+			return false;
+		}
+	}
+}
@@ -0,0 +1,185 @@
+/*
+ * SHA-256 using the x86 SHA extensions (sha256rnds2/sha256msg1/sha256msg2)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+#include "miner.h"
+
+#ifdef WANT_SHANI
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <immintrin.h>
+
+#ifdef WANT_CPU_DISPATCH
+#pragma GCC target("sha,sse4.1")
+#endif
+
+static const uint32_t sha256_consts[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] __attribute__((aligned(16))) = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define K(q)	_mm_load_si128((const __m128i *)&sha256_consts[4 * (q)])
+
+/* Four rounds: two sha256rnds2, each consuming two words of msg + K */
+#define QROUND(s0, s1, m, q) do { \
+	__m128i msg = _mm_add_epi32((m), K(q)); \
+	s1 = _mm_sha256rnds2_epu32(s1, s0, msg); \
+	msg = _mm_shuffle_epi32(msg, 0x0e); \
+	s0 = _mm_sha256rnds2_epu32(s0, s1, msg); \
+} while (0)
+
+/* Finish W[4q+4..4q+7] in m1 from m0 (W[4q..4q+3]) and mp (the group before) */
+#define MSG2(m1, m0, mp) do { \
+	m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, mp, 4)); \
+	m1 = _mm_sha256msg2_epu32(m1, m0); \
+} while (0)
+
+#define MSG1(mp, m0)	(mp = _mm_sha256msg1_epu32(mp, m0))
+
+/* A B C D / E F G H in memory order <-> the ABEF / CDGH lanes rnds2 wants */
+static inline void to_abef(const uint32_t *st, __m128i *abef, __m128i *cdgh)
+{
+	__m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[0]), 0xb1);
+	__m128i u = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[4]), 0x1b);
+
+	*abef = _mm_alignr_epi8(t, u, 8);
+	*cdgh = _mm_blend_epi16(u, t, 0xf0);
+}
+
+static inline void from_abef(__m128i abef, __m128i cdgh, __m128i *abcd, __m128i *efgh)
+{
+	__m128i t = _mm_shuffle_epi32(abef, 0x1b);
+	__m128i u = _mm_shuffle_epi32(cdgh, 0xb1);
+
+	*abcd = _mm_blend_epi16(t, u, 0xf0);
+	*efgh = _mm_alignr_epi8(u, t, 8);
+}
+
+/*
+ * 64 rounds over the message words m0..m3 (W[0..15], already in host order).
+ * With early set, stop after round 61: F then holds what will become H7,
+ * and the caller can reject the nonce without the last two rounds.
+ */
+static inline void sha256_shani_rounds(__m128i *pabef, __m128i *pcdgh,
+	__m128i m0, __m128i m1, __m128i m2, __m128i m3, const bool early)
+{
+	__m128i s0 = *pabef, s1 = *pcdgh;
+
+	QROUND(s0, s1, m0, 0);
+	QROUND(s0, s1, m1, 1);  MSG1(m0, m1);
+	QROUND(s0, s1, m2, 2);  MSG1(m1, m2);
+	QROUND(s0, s1, m3, 3);  MSG2(m0, m3, m2); MSG1(m2, m3);
+	QROUND(s0, s1, m0, 4);  MSG2(m1, m0, m3); MSG1(m3, m0);
+	QROUND(s0, s1, m1, 5);  MSG2(m2, m1, m0); MSG1(m0, m1);
+	QROUND(s0, s1, m2, 6);  MSG2(m3, m2, m1); MSG1(m1, m2);
+	QROUND(s0, s1, m3, 7);  MSG2(m0, m3, m2); MSG1(m2, m3);
+	QROUND(s0, s1, m0, 8);  MSG2(m1, m0, m3); MSG1(m3, m0);
+	QROUND(s0, s1, m1, 9);  MSG2(m2, m1, m0); MSG1(m0, m1);
+	QROUND(s0, s1, m2, 10); MSG2(m3, m2, m1); MSG1(m1, m2);
+	QROUND(s0, s1, m3, 11); MSG2(m0, m3, m2); MSG1(m2, m3);
+	QROUND(s0, s1, m0, 12); MSG2(m1, m0, m3); MSG1(m3, m0);
+	QROUND(s0, s1, m1, 13); MSG2(m2, m1, m0);
+	QROUND(s0, s1, m2, 14); MSG2(m3, m2, m1);
+
+	if (early) {
+		s1 = _mm_sha256rnds2_epu32(s1, s0, _mm_add_epi32(m3, K(15)));
+		*pabef = s1;
+		return;
+	}
+
+	QROUND(s0, s1, m3, 15);
+
+	*pabef = _mm_add_epi32(s0, *pabef);
+	*pcdgh = _mm_add_epi32(s1, *pcdgh);
+}
+
+bool scanhash_shani(int thr_id, const unsigned char *midstate, unsigned char *data,
+	        unsigned char *hash1, unsigned char *hash,
+		const unsigned char *target,
+	        uint32_t max_nonce, unsigned long *hashes_done,
+		uint32_t n)
+{
+	uint32_t *nonce = (uint32_t *)(data + 12);
+	const uint32_t *pad = (const uint32_t *)hash1;
+	__m128i mid_abef, mid_cdgh, init_abef, init_cdgh;
+	__m128i d0, d1, d2, d3, p2, p3;
+
+	work_restart[thr_id].restart = 0;
+
+	to_abef((const uint32_t *)midstate, &mid_abef, &mid_cdgh);
+	to_abef(sha256_init, &init_abef, &init_cdgh);
+
+	/* the second block's tail is the fixed hash1 padding */
+	p2 = _mm_loadu_si128((const __m128i *)&pad[8]);
+	p3 = _mm_loadu_si128((const __m128i *)&pad[12]);
+
+	d1 = _mm_loadu_si128((const __m128i *)(data + 16));
+	d2 = _mm_loadu_si128((const __m128i *)(data + 32));
+	d3 = _mm_loadu_si128((const __m128i *)(data + 48));
+
+	while (1) {
+		__m128i abef, cdgh, h0, h1;
+
+		n++;
+		*nonce = n;
+		d0 = _mm_loadu_si128((const __m128i *)data);
+
+		abef = mid_abef;
+		cdgh = mid_cdgh;
+		sha256_shani_rounds(&abef, &cdgh, d0, d1, d2, d3, false);
+		from_abef(abef, cdgh, &h0, &h1);
+
+		abef = init_abef;
+		cdgh = init_cdgh;
+		sha256_shani_rounds(&abef, &cdgh, h0, h1, p2, p3, true);
+
+		/* F after round 61 plus the initial H is the final H7 */
+		if (unlikely((uint32_t)_mm_cvtsi128_si32(abef) + sha256_init[7] == 0)) {
+			abef = init_abef;
+			cdgh = init_cdgh;
+			sha256_shani_rounds(&abef, &cdgh, h0, h1, p2, p3, false);
+			from_abef(abef, cdgh, &h0, &h1);
+			_mm_storeu_si128((__m128i *)hash, h0);
+			_mm_storeu_si128((__m128i *)(hash + 16), h1);
+
+			if (fulltest(hash, target)) {
+				*hashes_done = n;
+				return true;
+			}
+		}
+
+		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+			*hashes_done = n;
+			return false;
+		}
+	}
+}
+
+#endif /* WANT_SHANI */
@@ -17,8 +17,9 @@
 
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
-#include <xmmintrin.h>
+#include <emmintrin.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -49,6 +50,81 @@ static uint32_t g_sha256_hinit[8] =
 
 __m128i g_4sha256_k[64];
 
+/* Per-thread copy of the lane buffers the scan used to rebuild every call */
+struct sse4_64_ctx {
+    __m128i m_4w[64];
+    __m128i m_4hash[64];
+    __m128i m_4hash1[64];
+    uint32_t m_midstate[8];
+    uint32_t m_w[16];
+    uint32_t m_w1[16];
+    bool valid;
+};
+
+static pthread_once_t sse4_64_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sse4_64_key;
+
+static void sse4_64_ctx_free(void *ctx)
+{
+    _mm_free(ctx);
+}
+
+/* The round constants are shared read-only by all threads once set */
+static void sse4_64_init(void)
+{
+    int i;
+
+    for (i = 0; i < 64; i++)
+	g_4sha256_k[i] = _mm_set1_epi32(g_sha256_k[i]);
+
+    if (unlikely(pthread_key_create(&sse4_64_key, sse4_64_ctx_free)))
+	quit(1, "Failed to create sse4_64 thread key");
+}
+
+static struct sse4_64_ctx *sse4_64_get_ctx(void)
+{
+    struct sse4_64_ctx *ctx;
+
+    pthread_once(&sse4_64_once, sse4_64_init);
+
+    ctx = pthread_getspecific(sse4_64_key);
+    if (unlikely(!ctx)) {
+	ctx = _mm_malloc(sizeof(*ctx), 0x100);
+	if (unlikely(!ctx))
+	    quit(1, "Failed to malloc sse4_64 context");
+	memset(ctx, 0, sizeof(*ctx));
+	pthread_setspecific(sse4_64_key, ctx);
+    }
+    return ctx;
+}
+
+/* Reload whatever differs from the work this thread scanned last */
+static void sse4_64_ctx_update(struct sse4_64_ctx *ctx, const unsigned char *pmidstate,
+	const unsigned char *pdata, const unsigned char *phash1)
+{
+    uint32_t m_w[16];
+    int i;
+
+    memcpy(m_w, pdata, sizeof(m_w)); /* The 2nd half of the data */
+    m_w[3] = 0; /* the nonce lane is set per iteration */
+
+    /* Transmongrify */
+    if (!ctx->valid || memcmp(ctx->m_w1, phash1, sizeof(ctx->m_w1))) {
+	memcpy(ctx->m_w1, phash1, sizeof(ctx->m_w1));
+	for (i = 0; i < 16; i++)
+	    ctx->m_4hash1[i] = _mm_set1_epi32(ctx->m_w1[i]);
+    }
+
+    if (!ctx->valid || memcmp(ctx->m_w, m_w, sizeof(m_w))) {
+	memcpy(ctx->m_w, m_w, sizeof(m_w));
+	for (i = 0; i < 16; i++)
+	    ctx->m_4w[i] = _mm_set1_epi32(m_w[i]);
+    }
+
+    memcpy(ctx->m_midstate, pmidstate, sizeof(ctx->m_midstate));
+    ctx->valid = true;
+}
+
 int scanhash_sse4_64(int thr_id, const unsigned char *pmidstate,
 	unsigned char *pdata,
 	unsigned char *phash1, unsigned char *phash,
@@ -57,10 +133,8 @@ int scanhash_sse4_64(int thr_id, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     uint32_t *nNonce_p = (uint32_t *)(pdata + 12);
-    uint32_t m_midstate[8], m_w[16], m_w1[16];
-    __m128i m_4w[64], m_4hash[64], m_4hash1[64];
+    struct sse4_64_ctx *ctx = sse4_64_get_ctx();
     __m128i offset;
-    int i;
 
     work_restart[thr_id].restart = 0;
 
@@ -70,21 +144,7 @@ int scanhash_sse4_64(int thr_id, const unsigned char *pmidstate,
         uint32_t i[4];
     } mi;
 
-    /* Message expansion */
-    memcpy(m_midstate, pmidstate, sizeof(m_midstate));
-    memcpy(m_w, pdata, sizeof(m_w)); /* The 2nd half of the data */
-    memcpy(m_w1, phash1, sizeof(m_w1));
-    memset(m_4hash, 0, sizeof(m_4hash));
-
-    /* Transmongrify */
-    for (i = 0; i < 16; i++)
-        m_4w[i] = _mm_set1_epi32(m_w[i]);
-
-    for (i = 0; i < 16; i++)
-        m_4hash1[i] = _mm_set1_epi32(m_w1[i]);
-
-    for (i = 0; i < 64; i++)
-	g_4sha256_k[i] = _mm_set1_epi32(g_sha256_k[i]);
+    sse4_64_ctx_update(ctx, pmidstate, pdata, phash1);
 
     offset = _mm_set_epi32(0x3, 0x2, 0x1, 0x0);
 
@@ -92,29 +152,26 @@ int scanhash_sse4_64(int thr_id, const unsigned char *pmidstate,
     {
 	int j;
 
-	m_4w[3] = _mm_add_epi32(offset, _mm_set1_epi32(nonce));
+	ctx->m_4w[3] = _mm_add_epi32(offset, _mm_set1_epi32(nonce));
 
 	/* Some optimization can be done here W.R.T. precalculating some hash */
-        CalcSha256_x64_sse4(m_4hash1, m_4w, m_midstate);
-	CalcSha256_x64_sse4(m_4hash, m_4hash1, g_sha256_hinit);
+        CalcSha256_x64_sse4(ctx->m_4hash1, ctx->m_4w, ctx->m_midstate);
+	CalcSha256_x64_sse4(ctx->m_4hash, ctx->m_4hash1, g_sha256_hinit);
 
 	for (j = 0; j < 4; j++) {
-	    mi.m = m_4hash[7];
+	    mi.m = ctx->m_4hash[7];
 	    if (unlikely(mi.i[j] == 0))
 		break;
         }
 
 	/* If j = true, we found a hit...so check it */
-	/* Use the C version for a check... */
+	/* Use the C version for a check, the asm only leaves H7 */
 	if (unlikely(j != 4)) {
-		for (i = 0; i < 8; i++) {
-		    mi.m = m_4hash[i];
-		    *(uint32_t *)&(phash)[i*4] = mi.i[j];
-		}
+		*nNonce_p = nonce + j;
+		sha256_double(pmidstate, pdata, phash1, phash);
 
 		if (fulltest(phash, ptarget)) {
 		     *nHashesDone = nonce;
-		     *nNonce_p = nonce + j;
 		     return nonce + j;
 		}
 	}
@@ -0,0 +1,394 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <jansson.h>
+#ifndef WIN32
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <netdb.h>
+#else
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define close(fd) closesocket(fd)
+#endif
+
+#include "miner.h"
+
+/*
+ * The stratum pool protocol: line delimited JSON-RPC both ways over one TCP
+ * connection.  The pool pushes jobs (mining.notify) and share difficulty
+ * (mining.set_difficulty) as they change; shares go back as mining.submit
+ * on the same connection without waiting for earlier answers.  A job is
+ * turned into a block template like getblocktemplate's, so the work is
+ * made by gbt_work() rolling our extranonce2.
+ */
+
+#if JANSSON_MAJOR_VERSION >= 2
+#define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
+#else
+#define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
+#endif
+
+#define STRATUM_LINE_MAX	(1 << 20)
+/* Seconds without a line before the connection is given up on; pools send
+ * jobs far more often than this */
+#define STRATUM_TIMEOUT		120
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Split "stratum+tcp://host:port" */
+static bool stratum_addr(const char *url, char *host, char *port)
+{
+	const char *p, *colon;
+
+	p = strstr(url, "://");
+	p = p ? p + 3 : url;
+	colon = strrchr(p, ':');
+	if (!colon || colon == p || colon - p > 255 || strlen(colon + 1) > 15)
+		return false;
+	memcpy(host, p, colon - p);
+	host[colon - p] = '\0';
+	strcpy(port, colon + 1);
+	p = strchr(port, '/');
+	if (p)
+		port[p - port] = '\0';
+	return *port != '\0';
+}
+
+static int stratum_open(struct pool *pool)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256], port[16];
+	int sock = -1, nodelay = 1;
+#ifdef WIN32
+	DWORD timeout_ms = STRATUM_TIMEOUT * 1000;
+#else
+	struct timeval timeout = { STRATUM_TIMEOUT, 0 };
+#endif
+
+	if (!stratum_addr(pool->rpc_url, host, port)) {
+		applog(LOG_ERR, "Invalid stratum URL %s", pool->rpc_url);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		applog(LOG_INFO, "Failed to resolve stratum host %s", host);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (!connect(sock, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock < 0) {
+		applog(LOG_INFO, "Failed to connect to stratum %s:%s", host, port);
+		return -1;
+	}
+
+	/* shares are small and should go out the moment they are found */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(nodelay));
+	/* a pool that has gone quiet is as good as gone, keepalive or not */
+#ifdef WIN32
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_ms, sizeof(timeout_ms));
+#else
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(timeout));
+#endif
+#ifdef CURL_HAS_SOCKOPT
+	json_rpc_call_sockopt_cb(NULL, sock, CURLSOCKTYPE_IPCXN);
+#endif
+	return sock;
+}
+
+/* Send one request line; any thread may call this */
+bool stratum_send(struct pool *pool, const char *s)
+{
+	size_t len = strlen(s), sent = 0;
+	bool ret = false;
+	char *line;
+
+	line = malloc(len + 2);
+	if (unlikely(!line))
+		return false;
+	memcpy(line, s, len);
+	line[len++] = '\n';
+	line[len] = '\0';
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Stratum send: %s", s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_up) {
+		while (sent < len) {
+			ssize_t n = send(pool->stratum_sock, line + sent, len - sent, MSG_NOSIGNAL);
+
+			if (n <= 0)
+				break;
+			sent += n;
+		}
+		ret = sent == len;
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	free(line);
+	return ret;
+}
+
+/* The next message from the pool, NULL once the connection has gone */
+json_t *stratum_recv(struct pool *pool)
+{
+	while (42) {
+		json_error_t err;
+		char *nl;
+		json_t *val;
+
+		nl = pool->stratum_len ? memchr(pool->stratum_buf, '\n', pool->stratum_len) : NULL;
+		if (!nl) {
+			ssize_t n;
+
+			if (pool->stratum_size - pool->stratum_len < 4096) {
+				size_t size = pool->stratum_size ? pool->stratum_size * 2 : 8192;
+				char *buf;
+
+				if (size > STRATUM_LINE_MAX) {
+					applog(LOG_INFO, "Stratum line too long from pool %d", pool->pool_no);
+					return NULL;
+				}
+				buf = realloc(pool->stratum_buf, size);
+				if (unlikely(!buf))
+					return NULL;
+				pool->stratum_buf = buf;
+				pool->stratum_size = size;
+			}
+			n = recv(pool->stratum_sock, pool->stratum_buf + pool->stratum_len,
+				 pool->stratum_size - pool->stratum_len - 1, 0);
+			if (n <= 0) {
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					applog(LOG_INFO, "Pool %d stratum silent for %d seconds",
+					       pool->pool_no, STRATUM_TIMEOUT);
+				return NULL;
+			}
+			pool->stratum_len += n;
+			continue;
+		}
+
+		*nl++ = '\0';
+		if (opt_protocol)
+			applog(LOG_DEBUG, "Stratum recv: %s", pool->stratum_buf);
+		val = JSON_LOADS(pool->stratum_buf, &err);
+		pool->stratum_len -= nl - pool->stratum_buf;
+		memmove(pool->stratum_buf, nl, pool->stratum_len);
+		if (val)
+			return val;
+		applog(LOG_INFO, "JSON decode of stratum line failed(%d): %s", err.line, err.text);
+	}
+}
+
+/* Wait out the response to request id, ignoring anything else */
+static json_t *stratum_reply(struct pool *pool, int id)
+{
+	json_t *val;
+
+	while ((val = stratum_recv(pool))) {
+		json_t *res = json_object_get(val, "result");
+
+		if (json_integer_value(json_object_get(val, "id")) == id && res) {
+			json_incref(res);
+			json_decref(val);
+			return res;
+		}
+		json_decref(val);
+	}
+	return NULL;
+}
+
+/* Connect and subscribe, then ask to be authorised without waiting */
+bool stratum_connect(struct pool *pool)
+{
+	const char *nonce1;
+	json_t *res;
+	char *s;
+	int n2size, sock, id;
+
+	sock = stratum_open(pool);
+	if (sock < 0)
+		return false;
+	pool->stratum_sock = sock;
+	pool->stratum_len = 0;
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_up = true;
+	mutex_unlock(&pool->stratum_lock);
+
+	s = malloc(strlen(pool->rpc_user) + strlen(pool->rpc_pass) + 128);
+	if (unlikely(!s))
+		goto err_out;
+	mutex_lock(&pool->pool_lock);
+	id = ++pool->stratum_id;
+	mutex_unlock(&pool->pool_lock);
+	sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\"%s/%s\"]}",
+		id, PACKAGE, VERSION);
+	if (!stratum_send(pool, s))
+		goto err_out;
+
+	res = stratum_reply(pool, id);
+	nonce1 = json_string_value(json_array_get(res, 1));
+	n2size = json_integer_value(json_array_get(res, 2));
+	if (!nonce1 || strlen(nonce1) % 2 || n2size < 1 || n2size > 16) {
+		applog(LOG_INFO, "Pool %d gave an invalid mining.subscribe result", pool->pool_no);
+		json_decref(res);
+		goto err_out;
+	}
+	free(pool->nonce1);
+	pool->nonce1 = strdup(nonce1);
+	pool->n2size = n2size;
+	pool->sdiff = 1;
+	json_decref(res);
+
+	mutex_lock(&pool->pool_lock);
+	pool->stratum_auth_id = ++pool->stratum_id;
+	mutex_unlock(&pool->pool_lock);
+	sprintf(s, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
+		pool->stratum_auth_id, pool->rpc_user, pool->rpc_pass);
+	if (!stratum_send(pool, s))
+		goto err_out;
+	free(s);
+
+	applog(LOG_INFO, "Pool %d stratum subscribed, extranonce1 %s, extranonce2 %d bytes",
+	       pool->pool_no, pool->nonce1, pool->n2size);
+	return true;
+
+err_out:
+	free(s);
+	stratum_disconnect(pool);
+	return false;
+}
+
+void stratum_disconnect(struct pool *pool)
+{
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_up) {
+		close(pool->stratum_sock);
+		pool->stratum_up = false;
+	}
+	mutex_unlock(&pool->stratum_lock);
+}
+
+/* The little endian target of share difficulty diff, without libm */
+static void stratum_target(unsigned char *target, double diff)
+{
+	double t;
+	int i;
+
+	if (diff <= 0)
+		diff = 1;
+	/* difficulty 1 is 0xffff << 208, so 0xffff0000 in word 6 */
+	t = 4294901760.0 / diff / 4294967296.0;
+	for (i = 7; i >= 0; i--) {
+		uint32_t w = t >= 4294967295.0 ? 0xffffffff : (uint32_t)t;
+		int j;
+
+		for (j = 0; j < 4; j++)
+			target[i * 4 + j] = w >> (j * 8);
+		t = (t - w) * 4294967296.0;
+	}
+}
+
+/* A block template from mining.notify's parameters */
+struct gbt_tmpl *stratum_decode(struct pool *pool, const json_t *params)
+{
+	const char *job_id, *prevhash, *coinb1, *coinb2, *version, *bits, *ntime;
+	size_t cb1_len, n1_len, cb2_len;
+	uint32_t prev32[8], *tmpl_prev32;
+	struct gbt_tmpl *tmpl;
+	json_t *branch;
+	int i;
+
+	job_id = json_string_value(json_array_get(params, 0));
+	prevhash = json_string_value(json_array_get(params, 1));
+	coinb1 = json_string_value(json_array_get(params, 2));
+	coinb2 = json_string_value(json_array_get(params, 3));
+	branch = json_array_get(params, 4);
+	version = json_string_value(json_array_get(params, 5));
+	bits = json_string_value(json_array_get(params, 6));
+	ntime = json_string_value(json_array_get(params, 7));
+	if (!job_id || !prevhash || !coinb1 || !coinb2 || !json_is_array(branch) ||
+	    !version || !bits || !ntime) {
+		applog(LOG_ERR, "JSON invalid stratum job");
+		return NULL;
+	}
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (unlikely(!tmpl)) {
+		applog(LOG_ERR, "Failed to calloc in stratum_decode");
+		return NULL;
+	}
+	tmpl->job_id = strdup(job_id);
+	tmpl->version = strtoul(version, NULL, 16);
+	tmpl->bits = strtoul(bits, NULL, 16);
+	tmpl->curtime = strtoul(ntime, NULL, 16);
+	gettimeofday(&tmpl->tv_fetched, NULL);
+	stratum_target(tmpl->target, pool->sdiff);
+
+	/* prevhash arrives with each 32 bit word byte swapped, as getwork's */
+	if (!hex2bin((unsigned char *)prev32, prevhash, 32))
+		goto err_out;
+	tmpl_prev32 = (uint32_t *)tmpl->prevhash;
+	for (i = 0; i < 8; i++)
+		tmpl_prev32[i] = swab32(prev32[i]);
+
+	/* coinb1, extranonce1 and our extranonce2, then coinb2 */
+	cb1_len = strlen(coinb1) / 2;
+	n1_len = strlen(pool->nonce1) / 2;
+	cb2_len = strlen(coinb2) / 2;
+	tmpl->cb_xnonce = cb1_len + n1_len;
+	tmpl->xnonce_len = pool->n2size;
+	tmpl->cb_len = tmpl->cb_xnonce + tmpl->xnonce_len + cb2_len;
+	tmpl->coinbase = calloc(1, tmpl->cb_len);
+	if (unlikely(!tmpl->job_id || !tmpl->coinbase))
+		goto err_out;
+	if (!hex2bin(tmpl->coinbase, coinb1, cb1_len) ||
+	    !hex2bin(tmpl->coinbase + cb1_len, pool->nonce1, n1_len) ||
+	    !hex2bin(tmpl->coinbase + tmpl->cb_xnonce + tmpl->xnonce_len, coinb2, cb2_len))
+		goto err_out;
+
+	/* the merkle branch is sent in internal byte order already */
+	tmpl->branch = calloc(json_array_size(branch) + 1, sizeof(*tmpl->branch));
+	if (unlikely(!tmpl->branch))
+		goto err_out;
+	for (i = 0; i < (int)json_array_size(branch); i++) {
+		const char *hash = json_string_value(json_array_get(branch, i));
+
+		if (!hash || !hex2bin(tmpl->branch[i], hash, 32))
+			goto err_out;
+	}
+	tmpl->nbranch = i;
+	return tmpl;
+
+err_out:
+	applog(LOG_ERR, "JSON invalid stratum job");
+	gbt_free(tmpl);
+	return NULL;
+}
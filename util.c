@@ -32,6 +32,14 @@
 # include <winsock2.h>
 # include <mstcpip.h>
 #endif
+#if defined(__i386__) || defined(__x86_64__)
+# include <cpuid.h>
+#endif
+#ifdef __linux__
+# include <limits.h>
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 #include "miner.h"
 #include "elist.h"
 
@@ -55,12 +63,7 @@ struct upload_buffer {
 
 struct header_info {
 	char		*lp_path;
-	bool		has_rolltime;
-};
-
-struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
+	int		rolltime;	/* secs ntime may be rolled, 0 if not, -1 if unlimited */
 };
 
 void vapplog(int prio, const char *fmt, va_list ap)
@@ -209,9 +212,13 @@ static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 			if (opt_debug)
 				applog(LOG_DEBUG, "X-Roll-Ntime: N found");
 		} else {
+			char *expire = strstr(val, "expire=");
+
+			/* A bare Y lets the work roll for as long as it lives,
+			 * which the caller fills in from its scan time */
+			hi->rolltime = expire ? atoi(expire + 7) : -1;
 			if (opt_debug)
-				applog(LOG_DEBUG, "X-Roll-Ntime found");
-			hi->has_rolltime = true;
+				applog(LOG_DEBUG, "X-Roll-Ntime found, expire %d", hi->rolltime);
 		}
 	}
 
@@ -275,27 +282,107 @@ int json_rpc_call_sockopt_cb(void *userdata, curl_socket_t fd, curlsocktype purp
 }
 #endif
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, bool *rolltime,
-		      struct pool *pool)
+/*
+ * DNS results, TLS sessions and open connections are shared by every handle,
+ * so a request can reuse a connection another handle made to the same pool.
+ */
+static CURLSH *net_share;
+static pthread_mutex_t net_share_lock[CURL_LOCK_DATA_LAST];
+
+static void net_share_lock_cb(CURL *curl, curl_lock_data data,
+			      curl_lock_access access, void *userptr)
 {
-	json_t *val, *err_val, *res_val;
-	int rc;
-	struct data_buffer all_data = { };
-	struct upload_buffer upload_data;
-	json_error_t err = { };
-	struct curl_slist *headers = NULL;
-	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
+	mutex_lock(&net_share_lock[data]);
+}
+
+static void net_share_unlock_cb(CURL *curl, curl_lock_data data, void *userptr)
+{
+	mutex_unlock(&net_share_lock[data]);
+}
+
+static void net_share_init(void)
+{
+	int i;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		if (unlikely(pthread_mutex_init(&net_share_lock[i], NULL)))
+			quit(1, "Failed to pthread_mutex_init");
+
+	net_share = curl_share_init();
+	if (unlikely(!net_share))
+		quit(1, "Failed to curl_share_init");
+	curl_share_setopt(net_share, CURLSHOPT_LOCKFUNC, net_share_lock_cb);
+	curl_share_setopt(net_share, CURLSHOPT_UNLOCKFUNC, net_share_unlock_cb);
+	curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if LIBCURL_VERSION_NUM >= 0x071700
+	curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+/* An idle handle kept for this pool and purpose, or a new one */
+static CURL *pool_curl_get(struct pool *pool, enum pool_curl purpose)
+{
+	CURL *curl = NULL;
+
+	mutex_lock(&pool->pool_lock);
+	if (pool->curl_nidle[purpose])
+		curl = pool->curl_idle[purpose][--pool->curl_nidle[purpose]];
+	mutex_unlock(&pool->pool_lock);
+
+	if (!curl)
+		curl = curl_easy_init();
+	return curl;
+}
+
+static void pool_curl_put(struct pool *pool, enum pool_curl purpose, CURL *curl)
+{
+	mutex_lock(&pool->pool_lock);
+	if (pool->curl_nidle[purpose] < POOL_CURL_IDLE) {
+		pool->curl_idle[purpose][pool->curl_nidle[purpose]++] = curl;
+		curl = NULL;
+	}
+	mutex_unlock(&pool->pool_lock);
+
+	curl_easy_cleanup(curl);
+}
+
+/* One JSON-RPC request, from setup until its response is decoded */
+struct json_rpc_req {
+	CURL			*curl;
+	char			*rpc_req;	/* async requests keep their own copy */
+	enum pool_curl		purpose;
+	struct data_buffer	all_data;
+	struct upload_buffer	upload_data;
+	struct curl_slist	*headers;
+	struct header_info	hi;
+	char			curl_err_str[CURL_ERROR_SIZE];
+	bool			probing;
+	struct pool		*pool;
+	CURLcode		rc;
+
+	json_rpc_cb		cb;		/* NULL for json_rpc_call */
+	void			*cb_arg;
+	json_t			*val;		/* json_rpc_deliver's, no transfer */
+	bool			done;
+	bool			orphaned;	/* json_rpc_call caller was cancelled */
+	struct list_head	list;		/* net_incoming */
+};
+
+static void json_rpc_setup(struct json_rpc_req *req, const char *url,
+			   const char *userpass, const char *rpc_req,
+			   bool probe, bool longpoll)
+{
+	CURL *curl = req->curl;
 	long timeout = longpoll ? (60 * 60) : 60;
-	struct header_info hi = { };
-	bool probing = false;
+	char len_hdr[64], user_agent_hdr[128];
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
 	if (probe) {
-		probing = !pool->probed;
+		req->probing = !req->pool->probed;
 		/* Probe for only 15 seconds */
 		timeout = 15;
 	}
@@ -311,13 +398,15 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+	curl_easy_setopt(curl, CURLOPT_SHARE, net_share);
 	if (userpass) {
 		curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
 		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
@@ -331,51 +420,69 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
+	req->upload_data.buf = rpc_req;
+	req->upload_data.len = strlen(rpc_req);
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) req->upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"Content-type: application/json");
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"X-Mining-Extensions: rollntime");
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	req->headers = curl_slist_append(req->headers, len_hdr);
+	req->headers = curl_slist_append(req->headers, user_agent_hdr);
+	req->headers = curl_slist_append(req->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+}
 
-	rc = curl_easy_perform(curl);
-	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+/* Decode the response to a finished transfer and reset its curl handle */
+static json_t *json_rpc_finish(struct json_rpc_req *req, int *rolltime)
+{
+	struct pool *pool = req->pool;
+	json_t *val, *err_val, *res_val;
+	json_error_t err = { };
+	long connects = 0;
+
+	/* blocking calls finish on their callers' threads, so these race */
+	curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects);
+	mutex_lock(&pool->pool_lock);
+	if (connects)
+		pool->conn_new++;
+	else if (!req->rc)
+		pool->conn_reused++;
+	mutex_unlock(&pool->pool_lock);
+
+	if (req->rc) {
+		applog(LOG_INFO, "HTTP request failed: %s", req->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
 
-	if (probing) {
+	if (req->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path) 
-			pool->hdr_path = hi.lp_path;
+		if (req->hi.lp_path) 
+			pool->hdr_path = req->hi.lp_path;
 		else
 			pool->hdr_path = NULL;
-	}
+	} else
+		free(req->hi.lp_path);
 
-	*rolltime = hi.has_rolltime;
+	*rolltime = req->hi.rolltime;
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(req->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
 		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", all_data.buf);
+			applog(LOG_DEBUG, "JSON protocol response:\n%s", req->all_data.buf);
 
 		goto err_out;
 	}
@@ -387,12 +494,13 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	}
 
 	/* JSON-RPC valid response returns a non-null 'result',
-	 * and a null 'error'.
+	 * and a null 'error'.  submitblock is the exception, its
+	 * result is null when the block is accepted.
 	 */
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
-	if (!res_val || json_is_null(res_val) ||
+	if (!res_val || (json_is_null(res_val) && req->purpose != POOL_CURL_SUBMIT) ||
 	    (err_val && !json_is_null(err_val))) {
 		char *s;
 
@@ -404,25 +512,260 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		applog(LOG_INFO, "JSON-RPC call failed: %s", s);
 
 		free(s);
+		json_decref(val);
 
 		goto err_out;
 	}
 
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
+	curl_easy_reset(req->curl);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
+	curl_easy_reset(req->curl);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
 	return NULL;
 }
 
+/*
+ * The network engine.  A single thread runs every transfer on one curl_multi
+ * handle: json_rpc_call_async() requests complete through their callback on
+ * that thread, and json_rpc_call() parks its caller until its transfer is
+ * done.  Responses that came some other way, over stratum, are handed to
+ * their callback on the same thread by json_rpc_deliver().  Before
+ * net_start() json_rpc_call() just performs the transfer itself.
+ */
+static CURLM *net_multi;
+static LIST_HEAD(net_incoming);
+static pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t net_cond = PTHREAD_COND_INITIALIZER;
+
+#define NET_POLL_MS	100	/* longest a new request waits without curl_multi_wakeup */
+
+static void json_rpc_req_free(struct json_rpc_req *req)
+{
+	if (req->cb) {
+		pool_curl_put(req->pool, req->purpose, req->curl);
+		free(req->rpc_req);
+	} else if (req->orphaned) {
+		databuf_free(&req->all_data);
+		curl_slist_free_all(req->headers);
+		free(req->hi.lp_path);
+	}
+	free(req);
+}
+
+static void net_submit(struct json_rpc_req *req)
+{
+	mutex_lock(&net_lock);
+	list_add_tail(&req->list, &net_incoming);
+	mutex_unlock(&net_lock);
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_wakeup(net_multi);
+#endif
+}
+
+static void net_complete(struct json_rpc_req *req)
+{
+	if (req->cb) {
+		int rolltime = 0;
+		json_t *val = json_rpc_finish(req, &rolltime);
+
+		req->cb(val, rolltime, req->cb_arg);
+		json_rpc_req_free(req);
+		return;
+	}
+
+	mutex_lock(&net_lock);
+	req->done = true;
+	if (req->orphaned)
+		json_rpc_req_free(req);
+	else
+		pthread_cond_broadcast(&net_cond);
+	mutex_unlock(&net_lock);
+}
+
+static void net_wait(void)
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_poll(net_multi, NULL, 0, 1000, NULL);
+#else
+	fd_set rfds, wfds, efds;
+	struct timeval tv;
+	long ms = NET_POLL_MS;
+	int maxfd = -1;
+
+	curl_multi_timeout(net_multi, &ms);
+	if (ms < 0 || ms > NET_POLL_MS)
+		ms = NET_POLL_MS;
+	tv.tv_sec = 0;
+	tv.tv_usec = ms * 1000;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	curl_multi_fdset(net_multi, &rfds, &wfds, &efds, &maxfd);
+	select(maxfd + 1, &rfds, &wfds, &efds, &tv);
+#endif
+}
+
+static void *net_thread(void *userdata)
+{
+	while (42) {
+		struct json_rpc_req *req, *tmp;
+		LIST_HEAD(delivered);
+		CURLMsg *msg;
+		int running, left;
+
+		mutex_lock(&net_lock);
+		list_for_each_entry_safe(req, tmp, &net_incoming, list) {
+			list_del(&req->list);
+			if (unlikely(req->orphaned)) {
+				json_rpc_req_free(req);
+				continue;
+			}
+			if (!req->curl) {
+				list_add_tail(&req->list, &delivered);
+				continue;
+			}
+			curl_multi_add_handle(net_multi, req->curl);
+		}
+		mutex_unlock(&net_lock);
+
+		/* outside net_lock, the callbacks may queue new requests */
+		list_for_each_entry_safe(req, tmp, &delivered, list) {
+			req->cb(req->val, 0, req->cb_arg);
+			free(req);
+		}
+
+		curl_multi_perform(net_multi, &running);
+		while ((msg = curl_multi_info_read(net_multi, &left))) {
+			CURL *curl = msg->easy_handle;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&req);
+			req->rc = msg->data.result;
+			curl_multi_remove_handle(net_multi, curl);
+			net_complete(req);
+		}
+
+		net_wait();
+	}
+
+	return NULL;
+}
+
+void net_start(void)
+{
+	pthread_t pth;
+
+	net_share_init();
+	net_multi = curl_multi_init();
+	if (unlikely(!net_multi))
+		quit(1, "Failed to curl_multi_init");
+	if (unlikely(pthread_create(&pth, NULL, net_thread, NULL)))
+		quit(1, "Failed to create network thread");
+	pthread_detach(pth);
+}
+
+bool json_rpc_call_async(const char *url, const char *userpass,
+			 const char *rpc_req, struct pool *pool,
+			 enum pool_curl purpose, json_rpc_cb cb, void *cb_arg)
+{
+	struct json_rpc_req *req = calloc(1, sizeof(*req));
+
+	if (unlikely(!req)) {
+		applog(LOG_ERR, "Failed to calloc json_rpc_req");
+		return false;
+	}
+	req->curl = pool_curl_get(pool, purpose);
+	req->rpc_req = strdup(rpc_req);
+	if (unlikely(!req->curl || !req->rpc_req)) {
+		applog(LOG_ERR, "CURL initialisation failed");
+		if (req->curl)
+			pool_curl_put(pool, purpose, req->curl);
+		free(req->rpc_req);
+		free(req);
+		return false;
+	}
+	req->pool = pool;
+	req->purpose = purpose;
+	req->cb = cb;
+	req->cb_arg = cb_arg;
+	json_rpc_setup(req, url, userpass, req->rpc_req, false, false);
+	net_submit(req);
+	return true;
+}
+
+/* Run cb with a response that did not come through curl */
+void json_rpc_deliver(json_t *val, json_rpc_cb cb, void *cb_arg)
+{
+	struct json_rpc_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (unlikely(!req) || !net_multi) {
+		free(req);
+		cb(val, 0, cb_arg);
+		return;
+	}
+	req->val = val;
+	req->cb = cb;
+	req->cb_arg = cb_arg;
+	net_submit(req);
+}
+
+/* Cleanup handler: runs with net_lock held if the caller is cancelled */
+static void json_rpc_orphan(void *userdata)
+{
+	struct json_rpc_req *req = userdata;
+
+	req->orphaned = true;
+	mutex_unlock(&net_lock);
+}
+
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool)
+{
+	struct json_rpc_req *req = calloc(1, sizeof(*req));
+	json_t *val;
+	int oldtype;
+
+	if (unlikely(!req)) {
+		applog(LOG_ERR, "Failed to calloc json_rpc_req");
+		return NULL;
+	}
+	req->curl = curl;
+	req->pool = pool;
+	json_rpc_setup(req, url, userpass, rpc_req, probe, longpoll);
+
+	if (!net_multi)
+		req->rc = curl_easy_perform(curl);
+	else {
+		/* the only cancellation point is the wait, with net_lock held */
+		pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
+		net_submit(req);
+		mutex_lock(&net_lock);
+		pthread_cleanup_push(json_rpc_orphan, req);
+		while (!req->done)
+			pthread_cond_wait(&net_cond, &net_lock);
+		pthread_cleanup_pop(0);
+		mutex_unlock(&net_lock);
+		pthread_setcanceltype(oldtype, NULL);
+	}
+
+	val = json_rpc_finish(req, rolltime);
+	free(req);
+	return val;
+}
+
 char *bin2hex(const unsigned char *p, size_t len)
 {
 	int i;
@@ -540,15 +883,235 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	return rc;
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+static uint64_t xgetbv0(void)
+{
+	uint32_t eax, edx;
+
+	__asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+static unsigned int detect_cpu_features(void)
+{
+	unsigned int eax, ebx, ecx, edx, max_leaf, features = 0;
+	uint64_t xcr0 = 0;
+
+	if (!__get_cpuid(0, &max_leaf, &ebx, &ecx, &edx))
+		return 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (edx & bit_SSE2)
+		features |= CPU_SSE2;
+	if (ecx & bit_SSE4_1)
+		features |= CPU_SSE4_1;
+
+	/* The YMM/ZMM state must also be enabled by the OS in XCR0 */
+	if (ecx & bit_OSXSAVE)
+		xcr0 = xgetbv0();
+
+	if (max_leaf < 7)
+		return features;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if ((ebx & bit_AVX2) && (xcr0 & 0x06) == 0x06)
+		features |= CPU_AVX2;
+	if ((ebx & bit_AVX512F) && (xcr0 & 0xe6) == 0xe6)
+		features |= CPU_AVX512;
+	/* sha256 rounds are driven with SSSE3/SSE4.1 shuffles and blends */
+	if ((ebx & bit_SHA) && (features & CPU_SSE4_1))
+		features |= CPU_SHA;
+
+	return features;
+}
+#else
+static unsigned int detect_cpu_features(void)
+{
+	return 0;
+}
+#endif
+
+unsigned int cpu_features(void)
+{
+	static unsigned int features;
+	static bool detected;
+
+	if (!detected) {
+		features = detect_cpu_features();
+		detected = true;
+	}
+	return features;
+}
+
+#define OBJ_POOLS_MAX	8
+#define OBJ_CACHE	32	/* objects a thread keeps to itself per pool */
+#define OBJ_SLAB	64	/* objects allocated at a time */
+
+struct obj_cache {
+	int	count;
+	void	*objs[OBJ_CACHE];
+};
+
+static struct obj_pool *obj_pools[OBJ_POOLS_MAX];
+static int nr_obj_pools;
+static pthread_mutex_t obj_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t obj_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t obj_cache_key;
+
+/* Move count objects from a thread cache onto the depot; pool->lock held */
+static void obj_depot_put(struct obj_pool *pool, struct obj_cache *c, int count)
+{
+	while (count--) {
+		void *obj = c->objs[--c->count];
+
+		*(void **)obj = pool->depot;
+		pool->depot = obj;
+		pool->nr_depot++;
+	}
+}
+
+/* Hand a dying thread's cached objects back to their depots */
+static void obj_cache_release(void *userdata)
+{
+	struct obj_cache *caches = userdata;
+	int i;
+
+	for (i = 0; i < nr_obj_pools; i++) {
+		struct obj_pool *pool = obj_pools[i];
+
+		if (!caches[i].count)
+			continue;
+		mutex_lock(&pool->lock);
+		obj_depot_put(pool, &caches[i], caches[i].count);
+		mutex_unlock(&pool->lock);
+	}
+	free(caches);
+}
+
+static void obj_cache_init(void)
+{
+	if (unlikely(pthread_key_create(&obj_cache_key, obj_cache_release)))
+		quit(1, "Failed to create object cache key");
+}
+
+static struct obj_cache *obj_cache_get(struct obj_pool *pool)
+{
+	struct obj_cache *caches;
+
+	if (unlikely(pool->id < 0)) {
+		mutex_lock(&obj_pools_lock);
+		if (pool->id < 0) {
+			if (unlikely(nr_obj_pools == OBJ_POOLS_MAX))
+				quit(1, "Too many object pools");
+			obj_pools[nr_obj_pools] = pool;
+			__atomic_store_n(&pool->id, nr_obj_pools++, __ATOMIC_RELEASE);
+		}
+		mutex_unlock(&obj_pools_lock);
+	}
+
+	pthread_once(&obj_cache_once, obj_cache_init);
+	caches = pthread_getspecific(obj_cache_key);
+	if (unlikely(!caches)) {
+		caches = calloc(OBJ_POOLS_MAX, sizeof(*caches));
+		if (unlikely(!caches))
+			quit(1, "Failed to calloc object cache");
+		pthread_setspecific(obj_cache_key, caches);
+	}
+	return &caches[pool->id];
+}
+
+void *obj_alloc(struct obj_pool *pool)
+{
+	struct obj_cache *c = obj_cache_get(pool);
+	void *obj;
+	int in_use, hw;
+
+	if (unlikely(!c->count)) {
+		mutex_lock(&pool->lock);
+		while (pool->depot && c->count < OBJ_CACHE / 2) {
+			obj = pool->depot;
+			pool->depot = *(void **)obj;
+			pool->nr_depot--;
+			c->objs[c->count++] = obj;
+		}
+		if (!c->count) {
+			char *slab = calloc(OBJ_SLAB, pool->size);
+			int i;
+
+			if (unlikely(!slab))
+				quit(1, "Failed to calloc %s slab", pool->name);
+			pool->total += OBJ_SLAB;
+			for (i = 0; i < OBJ_SLAB; i++) {
+				obj = slab + i * pool->size;
+				if (c->count < OBJ_CACHE / 2)
+					c->objs[c->count++] = obj;
+				else {
+					*(void **)obj = pool->depot;
+					pool->depot = obj;
+					pool->nr_depot++;
+				}
+			}
+		}
+		mutex_unlock(&pool->lock);
+	}
+
+	obj = c->objs[--c->count];
+	memset(obj, 0, pool->size);
+
+	in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+	hw = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+	while (in_use > hw && !__atomic_compare_exchange_n(&pool->high_water, &hw,
+				in_use, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return obj;
+}
+
+void obj_free(struct obj_pool *pool, void *obj)
+{
+	struct obj_cache *c;
+
+	if (!obj)
+		return;
+
+	c = obj_cache_get(pool);
+	if (unlikely(c->count == OBJ_CACHE)) {
+		mutex_lock(&pool->lock);
+		obj_depot_put(pool, c, OBJ_CACHE / 2);
+		mutex_unlock(&pool->lock);
+	}
+	c->objs[c->count++] = obj;
+	__atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+}
+
+int obj_pools_count(void)
+{
+	return __atomic_load_n(&nr_obj_pools, __ATOMIC_ACQUIRE);
+}
+
+struct obj_pool *obj_pool_get(int id)
+{
+	return obj_pools[id];
+}
+
+/*
+ * thread_q is a bounded multi-producer multi-consumer ring (Dmitry Vyukov's
+ * design).  Each cell's sequence number says whether it is free for the
+ * push at that position or holds data for the pop at that position, so
+ * neither side takes a lock or allocates.  Poppers that find the ring empty
+ * sleep on tq->event, on a futex where there is one and on the condvar
+ * otherwise.
+ */
 struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
+	int i;
 
 	tq = calloc(1, sizeof(*tq));
 	if (!tq)
 		return NULL;
 
-	INIT_LIST_HEAD(&tq->q);
+	for (i = 0; i < TQ_SIZE; i++)
+		tq->cells[i].seq = i;
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
 
@@ -557,16 +1120,9 @@ struct thread_q *tq_new(void)
 
 void tq_free(struct thread_q *tq)
 {
-	struct tq_ent *ent, *iter;
-
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
 
@@ -574,14 +1130,63 @@ void tq_free(struct thread_q *tq)
 	free(tq);
 }
 
-static void tq_freezethaw(struct thread_q *tq, bool frozen)
+static void tq_wake(struct thread_q *tq, bool all)
 {
+	__atomic_add_fetch(&tq->event, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&tq->waiters, __ATOMIC_SEQ_CST))
+		return;
+
+#ifdef __linux__
+	syscall(SYS_futex, &tq->event, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+		NULL, NULL, 0);
+#else
 	mutex_lock(&tq->mutex);
+	if (all)
+		pthread_cond_broadcast(&tq->cond);
+	else
+		pthread_cond_signal(&tq->cond);
+	mutex_unlock(&tq->mutex);
+#endif
+}
 
-	tq->frozen = frozen;
+/* Sleep until tq->event moves on from seen; false once abstime passes */
+static bool tq_wait(struct thread_q *tq, unsigned int seen, const struct timespec *abstime)
+{
+	bool ret = true;
+
+#ifdef __linux__
+	while (__atomic_load_n(&tq->event, __ATOMIC_SEQ_CST) == seen) {
+		if (syscall(SYS_futex, &tq->event,
+			    FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+			    seen, abstime, NULL, FUTEX_BITSET_MATCH_ANY) &&
+		    errno == ETIMEDOUT) {
+			ret = false;
+			break;
+		}
+	}
+#else
+	mutex_lock(&tq->mutex);
+	while (__atomic_load_n(&tq->event, __ATOMIC_SEQ_CST) == seen) {
+		int rc;
 
-	pthread_cond_signal(&tq->cond);
+		if (abstime)
+			rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+		else
+			rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+		if (rc == ETIMEDOUT) {
+			ret = false;
+			break;
+		}
+	}
 	mutex_unlock(&tq->mutex);
+#endif
+	return ret;
+}
+
+static void tq_freezethaw(struct thread_q *tq, bool frozen)
+{
+	tq->frozen = frozen;
+	tq_wake(tq, true);
 }
 
 void tq_freeze(struct thread_q *tq)
@@ -594,62 +1199,85 @@ void tq_thaw(struct thread_q *tq)
 	tq_freezethaw(tq, false);
 }
 
+/* Returns false if the queue is frozen or all TQ_SIZE slots are in use */
 bool tq_push(struct thread_q *tq, void *data)
 {
-	struct tq_ent *ent;
-	bool rc = true;
+	unsigned long pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
 
-	ent = calloc(1, sizeof(*ent));
-	if (!ent)
+	if (unlikely(tq->frozen))
 		return false;
 
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
+	while (1) {
+		unsigned long seq;
+		long dif;
+
+		cell = &tq->cells[pos % TQ_SIZE];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+	}
 
-	mutex_lock(&tq->mutex);
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
-	}
+	tq_wake(tq, false);
+	return true;
+}
 
-	pthread_cond_signal(&tq->cond);
-	mutex_unlock(&tq->mutex);
+static bool tq_trypop(struct thread_q *tq, void **data)
+{
+	unsigned long pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
+
+	while (1) {
+		unsigned long seq;
+		long dif;
+
+		cell = &tq->cells[pos % TQ_SIZE];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (pos + 1));
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	}
 
-	return rc;
+	*data = cell->data;
+	__atomic_store_n(&cell->seq, pos + TQ_SIZE, __ATOMIC_RELEASE);
+	return true;
 }
 
+/*
+ * As before, a pop that has to wait returns whatever the next push, freeze
+ * or thaw leaves behind, which is NULL if the queue is still empty, or NULL
+ * once abstime has passed.
+ */
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 {
-	struct tq_ent *ent;
 	void *rval = NULL;
-	int rc;
+	unsigned int seen;
 
-	mutex_lock(&tq->mutex);
+	if (tq_trypop(tq, &rval))
+		return rval;
 
-	if (!list_empty(&tq->q))
-		goto pop;
+	seen = __atomic_load_n(&tq->event, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
+	if (!tq_trypop(tq, &rval) && tq_wait(tq, seen, abstime))
+		tq_trypop(tq, &rval);
+	__atomic_sub_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
 
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
-
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
-
-	list_del(&ent->q_node);
-	free(ent);
-
-out:
-	mutex_unlock(&tq->mutex);
 	return rval;
 }
 
@@ -658,6 +1286,7 @@ int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (
 	int ret;
 
 	ret = pthread_create(&thr->pth, attr, start, arg);
+	thr->started = !ret;
 	return ret;
 }
 
@@ -668,6 +1297,10 @@ void thr_info_cancel(struct thr_info *thr)
 
 	if (thr->q)
 		tq_freeze(thr->q);
+	/* e.g. the longpoll thread when no pool long polls */
+	if (!thr->started)
+		return;
+	thr->started = false;
 	if (pthread_cancel(thr->pth))
 		pthread_join(thr->pth, NULL);
 }